@@ -0,0 +1,89 @@
+# Pipelined memcached meta protocol load generator.
+#
+#   ruby -Ilib -Iext bench/memcache_load.rb [options]
+#
+# Without --port/--unix it forks embedded InMemoryKV::Server, so it could be
+# run in CI without external services.
+require 'optparse'
+require 'socket'
+
+opts = {
+  host: '127.0.0.1', port: nil, unix: nil,
+  conns: 4, pipeline: 32, requests: 200_000,
+  keys: 10_000, value_size: 100, gets: 0.9,
+}
+OptionParser.new do |o|
+  o.on('--host HOST') { |v| opts[:host] = v }
+  o.on('--port PORT', Integer) { |v| opts[:port] = v }
+  o.on('--unix PATH') { |v| opts[:unix] = v }
+  o.on('--conns N', Integer) { |v| opts[:conns] = v }
+  o.on('--pipeline N', Integer) { |v| opts[:pipeline] = v }
+  o.on('--requests N', Integer) { |v| opts[:requests] = v }
+  o.on('--keys N', Integer) { |v| opts[:keys] = v }
+  o.on('--value-size N', Integer) { |v| opts[:value_size] = v }
+  o.on('--gets RATIO', Float) { |v| opts[:gets] = v }
+end.parse!
+
+server_pid = nil
+unless opts[:port] || opts[:unix]
+  require 'inmemory_kv'
+  listener = TCPServer.new(opts[:host], 0)
+  opts[:port] = listener.local_address.ip_port
+  server_pid = fork do
+    InMemoryKV::Server.new(InMemoryKV::Str2Str.new, listener).run
+  end
+  listener.close
+end
+
+def connect(opts)
+  opts[:unix] ? UNIXSocket.new(opts[:unix]) : TCPSocket.new(opts[:host], opts[:port])
+end
+
+value = 'x' * opts[:value_size]
+sock = connect(opts)
+opts[:keys].times do |i|
+  sock.write("ms key#{i} #{value.bytesize} q\r\n#{value}\r\n")
+end
+sock.write("mn\r\n")
+sock.gets
+sock.close
+
+per_conn = opts[:requests] / opts[:conns]
+start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+threads = Array.new(opts[:conns]) do |t|
+  Thread.new do
+    rnd = Random.new(t)
+    s = connect(opts)
+    done = 0
+    while done < per_conn
+      batch = [opts[:pipeline], per_conn - done].min
+      req = ''.b
+      batch.times do
+        key = "key#{rnd.rand(opts[:keys])}"
+        if rnd.rand < opts[:gets]
+          req << "mg #{key} v\r\n"
+        else
+          req << "ms #{key} #{value.bytesize}\r\n#{value}\r\n"
+        end
+      end
+      s.write(req)
+      batch.times do
+        line = s.gets
+        s.read(line[3..-1].to_i + 2) if line.start_with?('VA ')
+      end
+      done += batch
+    end
+    s.close
+  end
+end
+threads.each(&:join)
+elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+
+total = per_conn * opts[:conns]
+printf("%d requests, %d conns, pipeline %d: %.3fs, %.0f req/s\n",
+       total, opts[:conns], opts[:pipeline], elapsed, total / elapsed)
+
+if server_pid
+  Process.kill(:TERM, server_pid)
+  Process.wait(server_pid)
+end
@@ -1,4 +1,9 @@
 require 'mkmf'
 have_func('malloc_usable_size')
 have_func('rb_memhash')
+have_header('sys/epoll.h')
+have_func('mmap', 'sys/mman.h')
+have_func('rb_ext_ractor_safe')
+# 64 bit positions and sizes, for tables past 4G entries or 4GB values
+$defs << '-DKV_LARGE_TABLE' if enable_config('large-table')
 create_makefile("inmemory_kv")
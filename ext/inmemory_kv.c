@@ -9,16 +9,60 @@
 #include <stdlib.h>
 #endif
 #include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+#include <ruby/thread.h>
 
 typedef unsigned int u32;
 typedef unsigned char u8;
+typedef unsigned long long u64;
+
+/* Default table keeps entry positions, hashes and key/value sizes in 32 bits.
+ * KV_LARGE_TABLE (extconf.rb --enable-large-table) widens them to 64 bits
+ * for tables past 4G entries or values past 4GB, at cost of 40 byte entries
+ * instead of 24 and bigger item headers. */
+#ifdef KV_LARGE_TABLE
+typedef u64 kv_pos;
+typedef u64 kv_len;
+typedef u64 kv_hval;
+typedef unsigned __int128 kv_wide; /* holds product of two positions */
+#define POS2NUM(v) ULL2NUM(v)
+#define NUM2POS(v) NUM2ULL(v)
+#define LEN2NUM(v) ULL2NUM(v)
+#else
+typedef u32 kv_pos;
+typedef u32 kv_len;
+typedef u32 kv_hval;
+typedef u64 kv_wide;
+#define POS2NUM(v) UINT2NUM(v)
+#define NUM2POS(v) NUM2UINT(v)
+#define LEN2NUM(v) UINT2NUM(v)
+#endif
+/* largest entries count, (kv_pos)-1 is end marker */
+#define KV_POS_MAX ((kv_pos)0 - 2)
+/* largest key or value size, with room for header so sizes never wrap */
+#define KV_LEN_MAX ((kv_len)0 - 1024)
 
 typedef struct hash_item {
-	u32 pos;
-	u32 rc : 31;
+	kv_pos pos;
 	u32 big : 1;
 #ifndef HAVE_MALLOC_USABLE_SIZE
-	u32 item_size;
+	size_t item_size;
 #endif
 	union {
 		struct {
@@ -27,8 +71,8 @@ typedef struct hash_item {
 			char key[0];
 		} small;
 		struct {
-			u32 key_size;
-			u32 val_size;
+			kv_len key_size;
+			kv_len val_size;
 			char key[0];
 		} big;
 	} kind;
@@ -47,22 +91,22 @@ item_size(hash_item* item) {
 #endif
 
 static inline int
-item_need_big(u32 key_size, u32 val_size) {
+item_need_big(kv_len key_size, kv_len val_size) {
 	return key_size > 255 || val_size > 255;
 }
 
-static inline u32
+static inline kv_len
 item_key_size(hash_item* item) {
 	return item->big ? item->kind.big.key_size : item->kind.small.key_size;
 }
 
-static inline u32
+static inline kv_len
 item_val_size(hash_item* item) {
 	return item->big ? item->kind.big.val_size : item->kind.small.val_size;
 }
 
 static inline void
-item_set_sizes(hash_item* item, u32 key_size, u32 val_size) {
+item_set_sizes(hash_item* item, kv_len key_size, kv_len val_size) {
 	if (item_need_big(key_size, val_size)) {
 		item->big = 1;
 		item->kind.big.key_size = key_size;
@@ -75,7 +119,7 @@ item_set_sizes(hash_item* item, u32 key_size, u32 val_size) {
 }
 
 static inline void
-item_set_val_size(hash_item* item, u32 val_size) {
+item_set_val_size(hash_item* item, kv_len val_size) {
 	assert(val_size <= 255 || item->big == 1);
 	if (item->big) {
 		item->kind.big.val_size = val_size;
@@ -94,18 +138,33 @@ item_val(hash_item* item) {
 	return item_key(item) + item_key_size(item);
 }
 
-static inline u32
-item_need_size(u32 key_size, u32 val_size) {
+static inline size_t
+item_need_size(kv_len key_size, kv_len val_size) {
 	if (item_need_big(key_size, val_size)) {
-		return offsetof(hash_item, kind.big.key) + key_size + val_size;
+		return offsetof(hash_item, kind.big.key) + (size_t)key_size + val_size;
 	} else {
-		return offsetof(hash_item, kind.small.key) + key_size + val_size;
+		return offsetof(hash_item, kind.small.key) + (size_t)key_size + val_size;
 	}
 }
 
+/* item_size() of result is its capacity, so spare room could be used later */
+static hash_item*
+item_realloc(hash_item* item, size_t size) {
+#ifndef HAVE_MALLOC_USABLE_SIZE
+	size = (size + 7) & ~(size_t)7;
+#endif
+	item = realloc(item, size);
+#ifndef HAVE_MALLOC_USABLE_SIZE
+	if (item != NULL)
+		item->item_size = size;
+#endif
+	return item;
+}
+
 static inline int
-item_compatible(hash_item* item, u32 val_size) {
-	u32 key_size, need_size, have_size;
+item_compatible(hash_item* item, kv_len val_size) {
+	kv_len key_size;
+	size_t need_size, have_size;
 	key_size = item_key_size(item);
 	if (item->big != item_need_big(key_size, val_size))
 		return 0;
@@ -117,55 +176,475 @@ item_compatible(hash_item* item, u32 val_size) {
 }
 
 typedef struct hash_entry {
-	u32 hash;
-	u32 next;
-	u32 fwd;
-	u32 prev;
+	kv_hval hash;
+	kv_pos next;
+	kv_pos fwd;
+	kv_pos prev;
 	hash_item* item;
 } hash_entry;
 
+/* Clone shares items between tables. Entry holding item which may be shared
+ * is marked with ENTRY_SHARED bit in item pointer, and count of extra owners
+ * is kept in item_refs while item is held by more than one table. So shared
+ * item's memory is never written, and forked workers keep sharing its pages
+ * with parent even if they clone and mutate table.
+ * item_refs is guarded by lock, cause bulk operations run without GVL. */
+#define ENTRY_SHARED ((uintptr_t)1)
+
+static inline hash_item*
+entry_item(const hash_entry* e) {
+	return (hash_item*)((uintptr_t)e->item & ~ENTRY_SHARED);
+}
+
+static inline int
+entry_shared(const hash_entry* e) {
+	return ((uintptr_t)e->item & ENTRY_SHARED) != 0;
+}
+
+static inline void
+entry_set_shared(hash_entry* e) {
+	e->item = (hash_item*)((uintptr_t)e->item | ENTRY_SHARED);
+}
+
+/* Bulk passes over large tables (clone, rehash, destroy) are split between
+ * short lived native threads, caller processes first chunk itself. Threads
+ * are spawned per pass: it costs tens of microseconds against passes over
+ * millions of entries, and leaves nothing to care about on fork. */
+#define PARALLEL_MIN_CHUNK (1 << 15)
+#define PARALLEL_MAX_THREADS 64
+#define PARALLEL_DEFAULT_THREADS 8
+
+static u32 parallel_threads = 0; /* 0 means number of CPUs up to default */
+
+typedef void (*parallel_cb)(kv_pos from, kv_pos to, void* arg);
+
+typedef struct parallel_chunk {
+	parallel_cb cb;
+	void* arg;
+	kv_pos from;
+	kv_pos to;
+} parallel_chunk;
+
+static u32
+parallel_nthreads(void) {
+	long ncpu;
+	if (parallel_threads == 0) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		if (ncpu < 1) ncpu = 1;
+		parallel_threads = ncpu < PARALLEL_DEFAULT_THREADS ? ncpu : PARALLEL_DEFAULT_THREADS;
+	}
+	return parallel_threads;
+}
+
+static void*
+parallel_worker(void* arg) {
+	parallel_chunk* c = arg;
+	c->cb(c->from, c->to, c->arg);
+	return NULL;
+}
+
+/* calls cb over [0, n) split in chunks, returns when all chunks are done */
+static void
+kv_parallel(kv_pos n, parallel_cb cb, void* arg) {
+	parallel_chunk chunks[PARALLEL_MAX_THREADS];
+	pthread_t threads[PARALLEL_MAX_THREADS];
+	u32 nthreads = parallel_nthreads();
+	u32 i, started;
+	sigset_t all, old;
+	if (nthreads > n / PARALLEL_MIN_CHUNK)
+		nthreads = n / PARALLEL_MIN_CHUNK;
+	if (nthreads <= 1) {
+		cb(0, n, arg);
+		return;
+	}
+	for (i = 0; i < nthreads; i++) {
+		chunks[i].cb = cb;
+		chunks[i].arg = arg;
+		chunks[i].from = n / nthreads * i + n % nthreads * i / nthreads;
+		chunks[i].to = n / nthreads * (i + 1) + n % nthreads * (i + 1) / nthreads;
+	}
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (started = 1; started < nthreads; started++) {
+		if (pthread_create(&threads[started], NULL, parallel_worker, &chunks[started]) != 0)
+			break;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	/* chunks of threads which could not start are done here */
+	cb(chunks[0].from, chunks[0].to, arg);
+	for (i = started; i < nthreads; i++)
+		cb(chunks[i].from, chunks[i].to, arg);
+	for (i = 1; i < started; i++)
+		pthread_join(threads[i], NULL);
+}
+
+typedef struct item_ref {
+	hash_item* item;
+	u32 rc; /* owners - 1 */
+} item_ref;
+
+static struct {
+	item_ref* refs;
+	size_t size;
+	size_t mask;
+	pthread_mutex_t lock;
+} item_refs = {NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+
+
+static inline size_t
+item_ref_slot(hash_item* item) {
+	u64 h = (u64)(uintptr_t)item * 0x9E3779B97F4A7C15ULL;
+	return (size_t)(h ^ (h >> 29)) & item_refs.mask;
+}
+
+static item_ref*
+item_ref_find(hash_item* item) {
+	size_t i;
+	if (item_refs.size == 0) return NULL;
+	i = item_ref_slot(item);
+	while (item_refs.refs[i].item != NULL) {
+		if (item_refs.refs[i].item == item)
+			return &item_refs.refs[i];
+		i = (i + 1) & item_refs.mask;
+	}
+	return NULL;
+}
+
+#define ITEM_REFS_MIN 1024
+
+static int
+item_ref_rehash(size_t new_alloced) {
+	size_t alloced = item_refs.refs ? item_refs.mask + 1 : 0;
+	size_t i, j;
+	item_ref *old_refs = item_refs.refs, *new_refs;
+	new_refs = calloc(new_alloced, sizeof(item_ref));
+	if (new_refs == NULL)
+		return 0;
+	item_refs.refs = new_refs;
+	item_refs.mask = new_alloced - 1;
+	for (i = 0; i < alloced; i++) {
+		if (old_refs[i].item == NULL)
+			continue;
+		j = item_ref_slot(old_refs[i].item);
+		while (new_refs[j].item != NULL)
+			j = (j + 1) & item_refs.mask;
+		new_refs[j] = old_refs[i];
+	}
+	free(old_refs);
+	return 1;
+}
+
+/* ensures n more items could be counted without allocation */
+static int
+item_ref_reserve(size_t n) {
+	size_t alloced = item_refs.refs ? item_refs.mask + 1 : 0;
+	size_t new_alloced;
+	if ((item_refs.size + n) * 4 <= alloced * 3)
+		return 1;
+	new_alloced = alloced ? alloced : ITEM_REFS_MIN;
+	while ((item_refs.size + n) * 4 > new_alloced * 3)
+		new_alloced *= 2;
+	return item_ref_rehash(new_alloced);
+}
+
+/* item_ref_reserve should be called before. Could run in several threads
+ * under one lock, if each item is passed by one thread only: free slot is
+ * claimed with CAS. Returns 1 if new slot is taken, caller adds it to size. */
+static int
+item_ref_inc(hash_item* item) {
+	item_ref* refs = item_refs.refs;
+	hash_item *cur, *expected;
+	size_t i = item_ref_slot(item);
+	for (;;) {
+		cur = __atomic_load_n(&refs[i].item, __ATOMIC_RELAXED);
+		if (cur == item) {
+			refs[i].rc++;
+			return 0;
+		}
+		if (cur == NULL) {
+			expected = NULL;
+			if (__atomic_compare_exchange_n(&refs[i].item, &expected, item, 0,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				refs[i].rc = 1;
+				return 1;
+			}
+			continue;
+		}
+		i = (i + 1) & item_refs.mask;
+	}
+}
+
+static void
+item_ref_remove(item_ref* ref) {
+	item_ref* refs = item_refs.refs;
+	size_t mask = item_refs.mask;
+	size_t i = ref - refs, j = i, k;
+	for (;;) {
+		j = (j + 1) & mask;
+		if (refs[j].item == NULL)
+			break;
+		k = item_ref_slot(refs[j].item);
+		/* move back unless its home slot is cyclically in (i, j] */
+		if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+			refs[i] = refs[j];
+			i = j;
+		}
+	}
+	refs[i].item = NULL;
+	refs[i].rc = 0;
+	item_refs.size--;
+	/* table is released when clones diverged, and shrunk far below grow
+	 * threshold, so it doesn't thrash; failed shrink just keeps it */
+	if (item_refs.size == 0) {
+		free(item_refs.refs);
+		item_refs.refs = NULL;
+		item_refs.mask = 0;
+	} else if (mask + 1 > ITEM_REFS_MIN && item_refs.size * 16 < mask + 1) {
+		item_ref_rehash((mask + 1) / 2);
+	}
+}
+
+/* returns 1 if other table still holds item */
+static int
+item_ref_dec(hash_item* item) {
+	item_ref* ref = item_ref_find(item);
+	if (ref == NULL)
+		return 0;
+	if (--ref->rc == 0)
+		item_ref_remove(ref);
+	return 1;
+}
+
+/* drops table's hold on item, returns 1 if item should be freed */
+static int
+item_unref(hash_item* item, int shared) {
+	int held = 0;
+	if (shared) {
+		pthread_mutex_lock(&item_refs.lock);
+		held = item_ref_dec(item);
+		pthread_mutex_unlock(&item_refs.lock);
+	}
+	return !held;
+}
+
+/* Lazy free: large items and detached entries arrays are handed to
+ * background thread, so request threads don't pay for bulk free. */
+#define LAZY_FREE_THRESHOLD (256 * 1024)
+#define LAZY_FREE_TABLE_MIN 4096
+
+typedef struct lazy_job {
+	struct lazy_job* next;
+	hash_entry* entries;
+	kv_pos alloced;
+} lazy_job;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	void* items; /* linked through item's first word */
+	lazy_job* jobs;
+	size_t pending;
+	size_t threshold;
+	int started;
+} lazy_free = {
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+	NULL, NULL, 0, LAZY_FREE_THRESHOLD, 0
+};
+
+static void
+lazy_free_chunk(kv_pos from, kv_pos to, void* arg) {
+	hash_entry* entries = arg;
+	kv_pos i;
+	for (i = from; i < to; i++) {
+		hash_entry* e = &entries[i];
+		if (e->item != NULL && item_unref(entry_item(e), entry_shared(e)))
+			free(entry_item(e));
+	}
+}
+
+static void*
+lazy_free_thread(void* _ __attribute__((unused))) {
+	void *items, *next;
+	lazy_job *jobs, *job;
+	size_t done;
+	pthread_mutex_lock(&lazy_free.lock);
+	for (;;) {
+		while (lazy_free.items == NULL && lazy_free.jobs == NULL)
+			pthread_cond_wait(&lazy_free.cond, &lazy_free.lock);
+		items = lazy_free.items;
+		jobs = lazy_free.jobs;
+		lazy_free.items = NULL;
+		lazy_free.jobs = NULL;
+		pthread_mutex_unlock(&lazy_free.lock);
+		for (done = 0; items != NULL; items = next, done++) {
+			next = *(void**)items;
+			free(items);
+		}
+		for (; jobs != NULL; done++) {
+			job = jobs;
+			jobs = job->next;
+			kv_parallel(job->alloced, lazy_free_chunk, job->entries);
+			free(job->entries);
+			free(job);
+		}
+		pthread_mutex_lock(&lazy_free.lock);
+		lazy_free.pending -= done;
+	}
+	return NULL;
+}
+
+/* should be called with lock held, returns 0 if thread could not start */
+static int
+lazy_free_start(void) {
+	pthread_t th;
+	pthread_attr_t attr;
+	sigset_t all, old;
+	int err;
+	if (lazy_free.started)
+		return 1;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&th, &attr, lazy_free_thread, NULL);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err != 0)
+		return 0;
+	lazy_free.started = 1;
+	return 1;
+}
+
+static void
+item_free(hash_item* item) {
+	if (lazy_free.threshold == 0 || item_size(item) < lazy_free.threshold) {
+		free(item);
+		return;
+	}
+	pthread_mutex_lock(&lazy_free.lock);
+	if (!lazy_free_start()) {
+		pthread_mutex_unlock(&lazy_free.lock);
+		free(item);
+		return;
+	}
+	*(void**)item = lazy_free.items;
+	lazy_free.items = item;
+	lazy_free.pending++;
+	pthread_cond_signal(&lazy_free.cond);
+	pthread_mutex_unlock(&lazy_free.lock);
+}
+
+/* takes ownership of entries array and its items, returns 0 on failure */
+static int
+lazy_free_entries(hash_entry* entries, kv_pos alloced) {
+	lazy_job* job = malloc(sizeof(lazy_job));
+	if (job == NULL)
+		return 0;
+	pthread_mutex_lock(&lazy_free.lock);
+	if (!lazy_free_start()) {
+		pthread_mutex_unlock(&lazy_free.lock);
+		free(job);
+		return 0;
+	}
+	job->entries = entries;
+	job->alloced = alloced;
+	job->next = lazy_free.jobs;
+	lazy_free.jobs = job;
+	lazy_free.pending++;
+	pthread_cond_signal(&lazy_free.cond);
+	pthread_mutex_unlock(&lazy_free.lock);
+	return 1;
+}
+
+static void
+item_release(hash_item* item, int shared) {
+	if (item_unref(item, shared))
+		item_free(item);
+}
+
+static void
+kv_atfork_prepare(void) {
+	pthread_mutex_lock(&lazy_free.lock);
+	pthread_mutex_lock(&item_refs.lock);
+}
+
+static void
+kv_atfork_parent(void) {
+	pthread_mutex_unlock(&item_refs.lock);
+	pthread_mutex_unlock(&lazy_free.lock);
+}
+
+/* lazy free thread is not inherited, it is restarted on demand */
+static void
+kv_atfork_child(void) {
+	pthread_mutex_init(&item_refs.lock, NULL);
+	pthread_mutex_init(&lazy_free.lock, NULL);
+	pthread_cond_init(&lazy_free.cond, NULL);
+	lazy_free.started = 0;
+}
+
+/* checks item could be written in place, and drops stale mark */
+static int
+entry_exclusive(hash_entry* e) {
+	item_ref* ref;
+	if (!entry_shared(e))
+		return 1;
+	pthread_mutex_lock(&item_refs.lock);
+	ref = item_ref_find(entry_item(e));
+	pthread_mutex_unlock(&item_refs.lock);
+	if (ref != NULL)
+		return 0;
+	e->item = entry_item(e);
+	return 1;
+}
+
+/* LRU chain head, table has one, namespaced store has one per namespace */
+typedef struct hash_list {
+	kv_pos  first;
+	kv_pos  last;
+} hash_list;
+
 typedef struct hash_table {
 	hash_entry* entries;
-	u32* buckets;
-	u32  size;
-	u32  alloced;
-	u32  empty;
-	u32  first;
-	u32  last;
-	u32  nbuckets;
+	kv_pos* buckets;
+	kv_pos  size;
+	kv_pos  alloced;
+	kv_pos  empty;
+	hash_list lru;
+	kv_pos  nbuckets;
 } hash_table;
 
-static const u32 end = (u32)0 - 1;
+static const kv_pos end = (kv_pos)0 - 1;
 
-static u32 hash_first(hash_table* tab);
-static u32 hash_next(hash_table* tab, u32 pos);
-static u32 hash_hash_first(hash_table* tab, u32 hash);
-static u32 hash_hash_next(hash_table* tab, u32 hash, u32 pos);
-static u32 hash_insert(hash_table* tab, u32 hash);
-static void hash_up(hash_table* tab, u32 pos);
-static void hash_delete(hash_table* tab, u32 pos);
+static kv_pos hash_first(hash_list* lst);
+static kv_pos hash_next(hash_table* tab, kv_pos pos);
+static kv_pos hash_hash_first(hash_table* tab, kv_hval hash);
+static kv_pos hash_hash_next(hash_table* tab, kv_hval hash, kv_pos pos);
+static kv_pos hash_insert(hash_table* tab, hash_list* lst, kv_hval hash);
+static void hash_up(hash_table* tab, hash_list* lst, kv_pos pos);
+static void hash_delete_at(hash_table* tab, hash_list* lst, kv_pos pos, kv_pos prev);
 static void hash_destroy(hash_table* tab);
 static size_t hash_memsize(const hash_table* tab) {
 	return tab->alloced * sizeof(hash_entry) +
-		tab->nbuckets * sizeof(u32);
+		tab->nbuckets * sizeof(kv_pos);
 }
 
-static u32
-hash_first(hash_table* tab) {
-	return tab->first - 1;
+static kv_pos
+hash_first(hash_list* lst) {
+	return lst->first - 1;
 }
 
-static u32
-hash_next(hash_table* tab, u32 pos) {
+static kv_pos
+hash_next(hash_table* tab, kv_pos pos) {
 	if (pos == end || tab->alloced < pos) {
 		return end;
 	}
 	return tab->entries[pos].fwd - 1;
 }
 
-static u32
-hash_hash_first(hash_table* tab, u32 hash) {
-	u32 buc, pos;
+static kv_pos
+hash_hash_first(hash_table* tab, kv_hval hash) {
+	kv_pos buc, pos;
 	if (tab->size == 0) return end;
 	buc = hash % tab->nbuckets;
 	pos = tab->buckets[buc] - 1;
@@ -175,21 +654,58 @@ hash_hash_first(hash_table* tab, u32 hash) {
 	return pos;
 }
 
-static u32
-hash_hash_next(hash_table* tab, u32 hash, u32 pos) {
+static kv_pos
+hash_hash_next(hash_table* tab, kv_hval hash, kv_pos pos) {
+	if (pos == end || tab->size == 0) return end;
+	do {
+		pos = tab->entries[pos].next - 1;
+	} while (pos != end && tab->entries[pos].hash != hash);
+	return pos;
+}
+
+/* same as hash_hash_first/hash_hash_next, but remember predecessor in bucket
+ * chain, so found entry could be deleted with hash_delete_at without rewalk */
+static kv_pos
+hash_chain_first(hash_table* tab, kv_hval hash, kv_pos* prev) {
+	kv_pos pos;
+	*prev = end;
+	if (tab->size == 0) return end;
+	pos = tab->buckets[hash % tab->nbuckets] - 1;
+	while (pos != end && tab->entries[pos].hash != hash) {
+		*prev = pos;
+		pos = tab->entries[pos].next - 1;
+	}
+	return pos;
+}
+
+static kv_pos
+hash_chain_next(hash_table* tab, kv_hval hash, kv_pos pos, kv_pos* prev) {
 	if (pos == end || tab->size == 0) return end;
 	do {
+		*prev = pos;
 		pos = tab->entries[pos].next - 1;
 	} while (pos != end && tab->entries[pos].hash != hash);
 	return pos;
 }
 
+static kv_pos
+hash_chain_prev(hash_table* tab, kv_pos pos) {
+	kv_pos i, prev = end;
+	i = tab->buckets[tab->entries[pos].hash % tab->nbuckets] - 1;
+	while (i != pos && i != end) {
+		prev = i;
+		i = tab->entries[i].next - 1;
+	}
+	assert(i != end && i == pos);
+	return prev;
+}
+
 #if 0
 static void
-hash_print(hash_table* tab, const char* act, u32 pos) {
-	u32 i;
-	printf("%s %d size: %d first: %d last: %d\n", act, pos, tab->size, tab->first-1, tab->last-1);
-	i = tab->first;
+hash_print(hash_table* tab, hash_list* lst, const char* act, kv_pos pos) {
+	kv_pos i;
+	printf("%s %d size: %d first: %d last: %d\n", act, pos, tab->size, lst->first-1, lst->last-1);
+	i = lst->first;
 	while(i-1!=end) {
 		hash_entry* e = tab->entries + (i-1);
 		printf("\tpos: %d prev: %d fwd: %d\n", i-1, e->prev-1, e->fwd-1);
@@ -197,100 +713,150 @@ hash_print(hash_table* tab, const char* act, u32 pos) {
 	}
 }
 #else
-#define hash_print(tab, act, pos)
+#define hash_print(tab, lst, act, pos)
 #endif
 
 static inline void
-hash_enchain(hash_table* tab, u32 pos) {
-	tab->entries[pos].prev = tab->last;
-	if (tab->first == 0) {
-		tab->first = pos+1;
+hash_enchain(hash_table* tab, hash_list* lst, kv_pos pos) {
+	tab->entries[pos].prev = lst->last;
+	if (lst->first == 0) {
+		lst->first = pos+1;
 	} else {
-		tab->entries[tab->last-1].fwd = pos+1;
+		tab->entries[lst->last-1].fwd = pos+1;
 	}
-	tab->last = pos+1;
-	hash_print(tab, "enchain", pos);
+	lst->last = pos+1;
+	hash_print(tab, lst, "enchain", pos);
 }
 
 static inline void
-hash_enchain_first(hash_table* tab, u32 pos) {
-	tab->entries[pos].fwd = tab->first;
-	if (tab->last == 0) {
-		tab->last = pos+1;
+hash_enchain_first(hash_table* tab, hash_list* lst, kv_pos pos) {
+	tab->entries[pos].fwd = lst->first;
+	if (lst->last == 0) {
+		lst->last = pos+1;
 	} else {
-		tab->entries[tab->first-1].prev = pos+1;
+		tab->entries[lst->first-1].prev = pos+1;
 	}
-	tab->first = pos+1;
-	hash_print(tab, "enchain first", pos);
+	lst->first = pos+1;
+	hash_print(tab, lst, "enchain first", pos);
 }
 
 static inline void
-hash_unchain(hash_table* tab, u32 pos) {
-	if (tab->first == pos+1) {
-		tab->first = tab->entries[pos].fwd;
+hash_unchain(hash_table* tab, hash_list* lst, kv_pos pos) {
+	if (lst->first == pos+1) {
+		lst->first = tab->entries[pos].fwd;
 	} else {
 		tab->entries[tab->entries[pos].prev-1].fwd = tab->entries[pos].fwd;
 	}
-	if (tab->last == pos+1) {
-		tab->last = tab->entries[pos].prev;
+	if (lst->last == pos+1) {
+		lst->last = tab->entries[pos].prev;
 	} else {
 		tab->entries[tab->entries[pos].fwd-1].prev = tab->entries[pos].prev;
 	}
 	tab->entries[pos].fwd = 0;
 	tab->entries[pos].prev = 0;
-	hash_print(tab, "unchain", pos);
+	hash_print(tab, lst, "unchain", pos);
 }
 
 static void
-hash_up(hash_table* tab, u32 pos) {
+hash_up(hash_table* tab, hash_list* lst, kv_pos pos) {
 	assert(tab->entries[pos].item != NULL);
-	if (tab->last == pos+1) return;
-	hash_unchain(tab, pos);
-	hash_enchain(tab, pos);
+	if (lst->last == pos+1) return;
+	hash_unchain(tab, lst, pos);
+	hash_enchain(tab, lst, pos);
 }
 
 static void
-hash_down(hash_table* tab, u32 pos) {
+hash_down(hash_table* tab, hash_list* lst, kv_pos pos) {
 	assert(tab->entries[pos].item != NULL);
-	if (tab->first == pos+1) return;
-	hash_unchain(tab, pos);
-	hash_enchain_first(tab, pos);
+	if (lst->first == pos+1) return;
+	hash_unchain(tab, lst, pos);
+	hash_enchain_first(tab, lst, pos);
 }
 
-static u32
-hash_insert(hash_table* tab, u32 hash) {
-	u32 i, pos, buc, npos;
+static int
+hash_grow_entries(hash_table* tab, kv_pos new_alloced) {
+	kv_pos i;
+	hash_entry* new_entries;
+#ifdef KV_LARGE_TABLE
+	/* 32 bit positions can't overflow size_t */
+	if (new_alloced > SIZE_MAX / sizeof(hash_entry))
+		return 0;
+#endif
+	new_entries = realloc(tab->entries, sizeof(hash_entry)*new_alloced);
+	if (new_entries == NULL)
+		return 0;
+	tab->entries = new_entries;
+	memset(tab->entries + tab->alloced, 0,
+			sizeof(hash_entry)*(new_alloced - tab->alloced));
+	for (i=tab->alloced; i<new_alloced-1; i++) {
+		tab->entries[i].next = i+2;
+	}
+	tab->entries[new_alloced-1].next = tab->empty;
+	tab->empty = tab->alloced+1;
+	tab->alloced = new_alloced;
+	return 1;
+}
+
+/* bucket heads are swapped atomically, so chunks are rehashed in parallel;
+ * chain order then depends on timing, but nothing relies on it */
+static void
+hash_rehash_chunk(kv_pos from, kv_pos to, void* arg) {
+	hash_table* tab = arg;
+	kv_pos i, buc;
+	for (i=from; i<to; i++) {
+		if (tab->entries[i].item == NULL)
+			continue;
+		buc = tab->entries[i].hash % tab->nbuckets;
+		tab->entries[i].next = __atomic_exchange_n(&tab->buckets[buc], i+1,
+				__ATOMIC_RELAXED);
+	}
+}
+
+static int
+hash_grow_buckets(hash_table* tab, kv_pos new_nbuckets) {
+	kv_pos* new_buckets = calloc(new_nbuckets, sizeof(kv_pos));
+	if (new_buckets == NULL)
+		return 0;
+	free(tab->buckets);
+	tab->buckets = new_buckets;
+	tab->nbuckets = new_nbuckets;
+	kv_parallel(tab->alloced, hash_rehash_chunk, tab);
+	return 1;
+}
+
+/* presizes table for n entries, so they are inserted without regrowth */
+static int
+hash_reserve(hash_table* tab, kv_pos n) {
+	kv_pos new_nbuckets = tab->nbuckets ? tab->nbuckets : 15;
+	if (n > KV_POS_MAX)
+		return 0;
+	if (n > tab->alloced && !hash_grow_entries(tab, n))
+		return 0;
+	while (n > new_nbuckets * 2 && new_nbuckets < KV_POS_MAX / 2)
+		new_nbuckets = (new_nbuckets+1)*2-1;
+	if (new_nbuckets != tab->nbuckets && !hash_grow_buckets(tab, new_nbuckets))
+		return 0;
+	return 1;
+}
+
+static kv_pos
+hash_insert(hash_table* tab, hash_list* lst, kv_hval hash) {
+	kv_pos pos, buc, npos;
 	if (tab->size == tab->alloced) {
-		u32 new_alloced = tab->alloced ? tab->alloced * 1.5 : 32;
-		hash_entry* new_entries = realloc(tab->entries,
-				sizeof(hash_entry)*new_alloced);
-		if (new_entries == NULL)
+		kv_pos new_alloced = tab->alloced ? tab->alloced + tab->alloced / 2 : 32;
+		/* positions are stored +1 and all-ones is end, so cap below both */
+		if (tab->alloced == KV_POS_MAX)
 			return end;
-		tab->entries = new_entries;
-		memset(tab->entries + tab->alloced, 0,
-				sizeof(hash_entry)*(new_alloced - tab->alloced));
-		for (i=tab->alloced; i<new_alloced-1; i++) {
-			tab->entries[i].next = i+2;
-		}
-		tab->empty = tab->alloced+1;
-		tab->alloced = new_alloced;
-	}
-	if (tab->size >= tab->nbuckets * 2) {
-		u32 new_nbuckets = tab->nbuckets ? (tab->nbuckets+1)*2-1 : 15;
-		u32* new_buckets = calloc(new_nbuckets, sizeof(u32));
-		if (new_buckets == NULL)
+		if (new_alloced > KV_POS_MAX || new_alloced < tab->alloced)
+			new_alloced = KV_POS_MAX;
+		if (!hash_grow_entries(tab, new_alloced))
+			return end;
+	}
+	/* past half of position range chains just get longer */
+	if (tab->size >= tab->nbuckets * 2 && tab->nbuckets < KV_POS_MAX / 2) {
+		kv_pos new_nbuckets = tab->nbuckets ? (tab->nbuckets+1)*2-1 : 15;
+		if (!hash_grow_buckets(tab, new_nbuckets))
 			return end;
-		free(tab->buckets);
-		tab->buckets = new_buckets;
-		for (i=0; i<tab->alloced; i++) {
-			if (tab->entries[i].item == NULL)
-				continue;
-			buc = tab->entries[i].hash % new_nbuckets;
-			npos = tab->buckets[buc];
-			tab->entries[i].next = npos;
-			tab->buckets[buc] = i+1;
-		}
-		tab->nbuckets = new_nbuckets;
 	}
 	buc = hash % tab->nbuckets;
 	npos = tab->buckets[buc];
@@ -302,30 +868,23 @@ hash_insert(hash_table* tab, u32 hash) {
 	tab->entries[pos].item = NULL;
 	tab->entries[pos].next = npos;
 	tab->entries[pos].fwd = 0;
-	hash_enchain(tab, pos);
+	hash_enchain(tab, lst, pos);
 	tab->size++;
 	return pos;
 }
 
+/* prev is predecessor of pos in bucket chain, end if pos is chain head */
 static void
-hash_delete(hash_table* tab, u32 pos) {
-	u32 hash, buc, i, j;
-	hash = tab->entries[pos].hash;
-	buc = hash % tab->nbuckets;
-	i = tab->buckets[buc] - 1;
-	j = end;
-	while (i != pos && i != end) {
-		j = i;
-		i = tab->entries[i].next - 1;
-	}
-	assert(i != end && i == pos);
-	if (j == end) {
-		tab->buckets[buc] = tab->entries[i].next;
+hash_delete_at(hash_table* tab, hash_list* lst, kv_pos pos, kv_pos prev) {
+	kv_pos i = pos;
+	if (prev == end) {
+		tab->buckets[tab->entries[i].hash % tab->nbuckets] = tab->entries[i].next;
 	} else {
-		tab->entries[j].next = tab->entries[i].next;
+		assert(tab->entries[prev].next == pos+1);
+		tab->entries[prev].next = tab->entries[i].next;
 	}
 	tab->entries[i].next = tab->empty;
-	hash_unchain(tab, i);
+	hash_unchain(tab, lst, i);
 	tab->empty = i+1;
 	tab->entries[i].hash = 0;
 	tab->entries[i].item = NULL;
@@ -338,94 +897,410 @@ hash_destroy(hash_table* tab) {
 	free(tab->buckets);
 }
 
-typedef struct inmemory_kv {
-	hash_table tab;
-	size_t total_size;
-} inmemory_kv;
+/* Change feed: compact binary log of mutations, so follower could replay them.
+ * Record is: op byte, varint seq, then for SET/DELETE/UP/DOWN varint key size
+ * and key, for SET also varint value size and value.
+ * EDIT is in-place edit of value: op byte, varint seq, key, edit kind byte,
+ * varint offset and data, replayed with kv_edit so value is not resent.
+ * SNAPSHOT is: op byte, varint seq, varint count and count of key/value pairs
+ * in LRU order. */
+enum kv_op {
+	KV_OP_SET = 1,
+	KV_OP_DELETE = 2,
+	KV_OP_UP = 3,
+	KV_OP_DOWN = 4,
+	KV_OP_CLEAR = 5,
+	KV_OP_SNAPSHOT = 6,
+	KV_OP_EDIT = 7,
+};
 
-static hash_item* kv_insert(inmemory_kv *kv, const char* key, u32 key_size, const char* val, u32 val_size);
-static hash_item* kv_fetch(inmemory_kv *kv, const char* key, u32 key_size);
-static void kv_up(inmemory_kv *kv, hash_item* item);
-static void kv_delete(inmemory_kv *kv, hash_item* item);
-static hash_item* kv_first(inmemory_kv *kv);
+typedef struct kv_feed {
+	char* buf;
+	size_t len;
+	size_t alloced;
+	u64 seq;
+	u64 applied;
+	u64 snap_left; /* pairs of snapshot being applied still to come */
+	u64 snap_seq;
+	u32 on : 1;
+	u32 lost : 1;
+} kv_feed;
 
-typedef void (*kv_each_cb)(hash_item* item, void* arg);
-static void kv_each(inmemory_kv *kv, kv_each_cb cb, void* arg);
+static int
+feed_reserve(kv_feed* feed, size_t need) {
+	size_t new_alloced;
+	char* new_buf;
+	if (feed->len + need <= feed->alloced)
+		return 1;
+	new_alloced = feed->alloced ? feed->alloced : 256;
+	while (new_alloced < feed->len + need)
+		new_alloced *= 2;
+	new_buf = realloc(feed->buf, new_alloced);
+	if (new_buf == NULL)
+		return 0;
+	feed->buf = new_buf;
+	feed->alloced = new_alloced;
+	return 1;
+}
 
-static void kv_copy_to(inmemory_kv *from, inmemory_kv *to);
+static inline char*
+feed_put_varint(char* p, u64 v) {
+	while (v >= 0x80) {
+		*p++ = (char)(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (char)v;
+	return p;
+}
 
-#ifdef HAV_RB_MEMHASH
-static inline u32
-kv_hash(const char* key, u32 key_size) {
-	return rb_memhash(key, key_size);
+static inline char*
+feed_put_str(char* p, const char* str, kv_len size) {
+	p = feed_put_varint(p, size);
+	memcpy(p, str, size);
+	return p + size;
 }
-#else
-static inline u32
-kv_hash(const char* key, u32 key_size) {
-	u32 a1 = 0xdeadbeef, a2 = 0x71fefeed;
-	u32 i;
-	for (i = 0; i<key_size; i++) {
-		unsigned char k = key[i];
-		a1 = (a1 + k) * 5;
-		a2 = (a2 ^ k) * 9;
+
+/* returns NULL if buffer is incomplete, sets *bad on garbage */
+static inline const char*
+feed_get_varint(const char* p, const char* end, u64* v, int* bad) {
+	u64 r = 0;
+	int shift = 0;
+	while (p < end) {
+		u8 c = *p++;
+		if (shift == 63 && c > 1) {
+			*bad = 1;
+			return NULL;
+		}
+		r |= (u64)(c & 0x7f) << shift;
+		if ((c & 0x80) == 0) {
+			*v = r;
+			return p;
+		}
+		shift += 7;
 	}
-	a1 ^= key_size; a1 *= 5; a2 *= 9;
-	return a1 ^ a2;
+	return NULL;
 }
-#endif
 
-static hash_item*
-kv_insert(inmemory_kv *kv, const char* key, u32 key_size, const char* val, u32 val_size) {
-	u32 hash = kv_hash(key, key_size);
-	u32 pos;
-	hash_item *item, *old_item = NULL;
-	pos = hash_hash_first(&kv->tab, hash);
-	while (pos != end) {
-		item = kv->tab.entries[pos].item;
-		if (item_key_size(item) == key_size &&
-				memcmp(key, item_key(item), key_size) == 0) {
-			break;
-		}
-		pos = hash_hash_next(&kv->tab, hash, pos);
+static inline const char*
+feed_get_str(const char* p, const char* end, const char** str, kv_len* size, int* bad) {
+	u64 sz;
+	p = feed_get_varint(p, end, &sz, bad);
+	if (p == NULL) return NULL;
+	if (sz > KV_LEN_MAX) {
+		*bad = 1;
+		return NULL;
 	}
-	if (pos == end) {
-		pos = hash_insert(&kv->tab, hash);
-		if (pos == end)
-			return NULL;
-		item = NULL;
-	} else {
-		hash_up(&kv->tab, pos);
-		if (!item_compatible(item, val_size) || item->rc > 0) {
-			old_item = item;
-			item = NULL;
-		}
+	if (sz > (u64)(end - p)) return NULL;
+	*str = p;
+	*size = sz;
+	return p + sz;
+}
+
+static void
+feed_record(kv_feed* feed, int op, const char* key, kv_len key_size, const char* val, kv_len val_size) {
+	char* p;
+	if (!feed->on || feed->lost) return;
+	if (!feed_reserve(feed, 1 + 10 + 10 + (size_t)key_size + 10 + (size_t)val_size)) {
+		feed->lost = 1;
+		return;
 	}
-	if (item == NULL) {
-		u32 new_size = item_need_size(key_size, val_size);
-#ifndef HAVE_MALLOC_USABLE_SIZE
-		new_size = (new_size + 7) & 7;
-#endif
-		item = malloc(new_size);
-		if (item == NULL) {
-			if (old_item == NULL) {
-				hash_delete(&kv->tab, pos);
-			}
-			return NULL;
-		}
-#ifdef HAVE_MALLOC_USABLE_SIZE
-		new_size = malloc_usable_size(item);
-#else
-		item->item_size = new_size;
+	p = feed->buf + feed->len;
+	*p++ = op;
+	p = feed_put_varint(p, ++feed->seq);
+	if (op != KV_OP_CLEAR)
+		p = feed_put_str(p, key, key_size);
+	if (op == KV_OP_SET)
+		p = feed_put_str(p, val, val_size);
+	feed->len = p - feed->buf;
+}
+
+static void
+feed_record_edit(kv_feed* feed, const char* key, kv_len key_size, int kind, u64 off, const char* data, kv_len size) {
+	char* p;
+	if (!feed->on || feed->lost) return;
+	if (!feed_reserve(feed, 1 + 10 + 10 + (size_t)key_size + 1 + 10 + 10 + (size_t)size)) {
+		feed->lost = 1;
+		return;
+	}
+	p = feed->buf + feed->len;
+	*p++ = KV_OP_EDIT;
+	p = feed_put_varint(p, ++feed->seq);
+	p = feed_put_str(p, key, key_size);
+	*p++ = kind;
+	p = feed_put_varint(p, off);
+	p = feed_put_str(p, size ? data : "", size);
+	feed->len = p - feed->buf;
+}
+
+static void
+feed_destroy(kv_feed* feed) {
+	free(feed->buf);
+	feed->buf = NULL;
+	feed->len = 0;
+	feed->alloced = 0;
+}
+
+/* Hot key sampler: Space-Saving top-K over roughly 1-in-rate sampled
+ * lookups. Countdown to next sample is random with mean rate, so periodic
+ * access patterns are not aliased; lookup pays only for decrement. */
+typedef struct kv_hot {
+	kv_hval hash;
+	kv_len key_size;
+	u64 count;
+	char* key;
+} kv_hot;
+
+typedef struct kv_sampler {
+	u32 rate;
+	u32 countdown;
+	u32 rnd;
+	u32 capacity;
+	u32 used;
+	kv_hot hot[1];
+} kv_sampler;
+
+#define SAMPLER_RATE_MAX (1 << 30)
+
+static kv_sampler*
+sampler_new(u32 rate, u32 capacity) {
+	kv_sampler* s = calloc(1, offsetof(kv_sampler, hot) + capacity*sizeof(kv_hot));
+	if (s == NULL)
+		return NULL;
+	s->rate = rate;
+	s->countdown = rate;
+	s->rnd = 0x9e3779b9 ^ rate;
+	s->capacity = capacity;
+	return s;
+}
+
+static void
+sampler_reset(kv_sampler* s) {
+	u32 i;
+	for (i = 0; i < s->used; i++)
+		free(s->hot[i].key);
+	memset(s->hot, 0, s->used*sizeof(kv_hot));
+	s->used = 0;
+}
+
+static void
+sampler_free(kv_sampler* s) {
+	if (s == NULL)
+		return;
+	sampler_reset(s);
+	free(s);
+}
+
+static kv_hot*
+sampler_find(kv_sampler* s, kv_hval hash, const char* key, kv_len key_size) {
+	u32 i;
+	for (i = 0; i < s->used; i++) {
+		kv_hot* h = &s->hot[i];
+		if (h->hash == hash && h->key_size == key_size &&
+				memcmp(h->key, key, key_size) == 0)
+			return h;
+	}
+	return NULL;
+}
+
+static void
+sampler_hit(kv_sampler* s, kv_hval hash, const char* key, kv_len key_size) {
+	kv_hot *h, *min;
+	char* copy;
+	u32 i;
+	s->rnd ^= s->rnd << 13;
+	s->rnd ^= s->rnd >> 17;
+	s->rnd ^= s->rnd << 5;
+	s->countdown = 1 + s->rnd % (2*s->rate - 1);
+	min = &s->hot[0];
+	for (i = 0; i < s->used; i++) {
+		h = &s->hot[i];
+		if (h->hash == hash && h->key_size == key_size &&
+				memcmp(h->key, key, key_size) == 0) {
+			h->count++;
+			return;
+		}
+		if (h->count < min->count)
+			min = h;
+	}
+	if (s->used < s->capacity) {
+		h = &s->hot[s->used];
+		h->count = 1;
+	} else {
+		/* replace least counted key, new one inherits its count */
+		h = min;
+		h->count++;
+	}
+	copy = realloc(h->key, key_size ? key_size : 1);
+	if (copy == NULL)
+		return;
+	memcpy(copy, key, key_size);
+	h->key = copy;
+	h->hash = hash;
+	h->key_size = key_size;
+	if (h == &s->hot[s->used])
+		s->used++;
+}
+
+/* Namespaced store shares one table between many logical tables.
+ * Namespace id is kept as NS_PREFIX bytes prefix of item's key, so it is
+ * mixed into hash and key comparison. Each namespace has its own LRU chain
+ * and accounting. */
+#define NS_PREFIX 4
+/* metadata is dense array indexed by id, so largest id costs 4MB */
+#define NS_MAX (1 << 17)
+
+typedef struct kv_ns {
+	hash_list lru;
+	kv_pos size;
+	size_t data_size;
+	size_t quota;
+} kv_ns;
+
+typedef struct inmemory_kv {
+	hash_table tab;
+	size_t total_size;
+	kv_feed feed;
+	kv_ns* ns; /* NULL for Str2Str */
+	u32 ns_alloced;
+	int busy; /* bulk operation runs without GVL */
+	u32 gen; /* bumped when entries are added, removed or rehashed */
+	kv_sampler* sampler; /* NULL unless hot keys are tracked */
+} inmemory_kv;
+
+static inline void
+kv_sample(inmemory_kv *kv, kv_hval hash, const char* key, kv_len key_size) {
+	if (kv->sampler != NULL && --kv->sampler->countdown == 0)
+		sampler_hit(kv->sampler, hash, key, key_size);
+}
+
+/* place of key found by kv_lookup: could be written or deleted without
+ * walking bucket chain again, while kv->gen stays the same */
+typedef struct kv_slot {
+	kv_hval hash;
+	kv_pos pos; /* end if key is absent */
+	kv_pos prev; /* predecessor in bucket chain, end if pos is chain head */
+} kv_slot;
+
+static inline kv_ns*
+kv_key_ns(inmemory_kv *kv, const char* key) {
+	u32 id;
+	if (kv->ns == NULL) return NULL;
+	memcpy(&id, key, NS_PREFIX);
+	return &kv->ns[id];
+}
+
+static inline hash_list*
+kv_ns_lru(inmemory_kv *kv, kv_ns* ns) {
+	return ns ? &ns->lru : &kv->tab.lru;
+}
+
+static hash_item* kv_insert(inmemory_kv *kv, const char* key, kv_len key_size, const char* val, kv_len val_size);
+static hash_item* kv_fetch(inmemory_kv *kv, const char* key, kv_len key_size);
+static hash_item* kv_lookup(inmemory_kv *kv, const char* key, kv_len key_size, kv_slot* slot);
+static hash_item* kv_write(inmemory_kv *kv, kv_slot* slot, hash_item* item, const char* key, kv_len key_size, const char* val, kv_len val_size);
+static int kv_edit(inmemory_kv *kv, kv_slot* slot, hash_item* item, const char* key, kv_len key_size, int op, u64 off, const char* data, kv_len size, hash_item** res);
+static void kv_delete_at(inmemory_kv *kv, kv_slot* slot, hash_item* item);
+static void kv_up(inmemory_kv *kv, hash_item* item);
+static void kv_delete(inmemory_kv *kv, hash_item* item);
+static void kv_clear(inmemory_kv *kv, int lazy);
+static hash_item* kv_first(inmemory_kv *kv);
+static hash_item* kv_first_in(inmemory_kv *kv, hash_list* lst);
+
+typedef void (*kv_each_cb)(hash_item* item, void* arg);
+static void kv_each(inmemory_kv *kv, kv_each_cb cb, void* arg);
+static void kv_each_in(inmemory_kv *kv, hash_list* lst, kv_each_cb cb, void* arg);
+
+static int kv_copy_to(inmemory_kv *from, inmemory_kv *to);
+
+#ifdef HAV_RB_MEMHASH
+static inline kv_hval
+kv_hash(const char* key, kv_len key_size) {
+	return rb_memhash(key, key_size);
+}
+#else
+static inline kv_hval
+kv_hash(const char* key, kv_len key_size) {
+	u32 a1 = 0xdeadbeef, a2 = 0x71fefeed;
+	kv_len i;
+	for (i = 0; i<key_size; i++) {
+		unsigned char k = key[i];
+		a1 = (a1 + k) * 5;
+		a2 = (a2 ^ k) * 9;
+	}
+	a1 ^= key_size; a1 *= 5; a2 *= 9;
+#ifdef KV_LARGE_TABLE
+	return ((kv_hval)a1 << 32) | a2;
+#else
+	return a1 ^ a2;
+#endif
+}
 #endif
+
+static hash_item*
+kv_lookup(inmemory_kv *kv, const char* key, kv_len key_size, kv_slot* slot) {
+	hash_item* item;
+	kv_pos pos;
+	slot->hash = kv_hash(key, key_size);
+	kv_sample(kv, slot->hash, key, key_size);
+	pos = hash_chain_first(&kv->tab, slot->hash, &slot->prev);
+	while (pos != end) {
+		item = entry_item(&kv->tab.entries[pos]);
+		if (item_key_size(item) == key_size &&
+				memcmp(key, item_key(item), key_size) == 0) {
+			slot->pos = pos;
+			return item;
+		}
+		pos = hash_chain_next(&kv->tab, slot->hash, pos, &slot->prev);
+	}
+	slot->pos = end;
+	return NULL;
+}
+
+/* item is what kv_lookup returned for this slot */
+static hash_item*
+kv_write(inmemory_kv *kv, kv_slot* slot, hash_item* item, const char* key, kv_len key_size, const char* val, kv_len val_size) {
+	kv_pos pos = slot->pos;
+	hash_item *old_item = NULL;
+	int old_shared = 0;
+	kv_ns* ns = kv_key_ns(kv, key);
+	hash_list* lst = kv_ns_lru(kv, ns);
+	if (pos == end) {
+		pos = hash_insert(&kv->tab, lst, slot->hash);
+		if (pos == end)
+			return NULL;
+		kv->gen++;
+		slot->pos = pos;
+		slot->prev = end;
+		item = NULL;
+		if (ns) ns->size++;
+	} else {
+		hash_up(&kv->tab, lst, pos);
+		if (!item_compatible(item, val_size) ||
+				!entry_exclusive(&kv->tab.entries[pos])) {
+			old_item = item;
+			old_shared = entry_shared(&kv->tab.entries[pos]);
+			item = NULL;
+		}
+	}
+	if (item == NULL) {
+		size_t new_size;
+		item = item_realloc(NULL, item_need_size(key_size, val_size));
+		if (item == NULL) {
+			if (old_item == NULL) {
+				hash_delete_at(&kv->tab, lst, pos, slot->prev);
+				slot->pos = end;
+				if (ns) ns->size--;
+			}
+			return NULL;
+		}
+		new_size = item_size(item);
 		if (old_item != NULL) {
 			kv->total_size -= item_size(old_item);
-			if (old_item->rc > 0)
-				old_item->rc--;
-			else
-				free(old_item);
+			if (ns) ns->data_size -= item_size(old_item);
+			item_release(old_item, old_shared);
 		}
-		item->rc = 0;
 		kv->total_size += new_size;
+		if (ns) ns->data_size += new_size;
 		item_set_sizes(item, key_size, val_size);
 		item->pos = pos;
 		memcpy(item_key(item), key, key_size);
@@ -433,106 +1308,363 @@ kv_insert(inmemory_kv *kv, const char* key, u32 key_size, const char* val, u32 v
 	item_set_val_size(item, val_size);
 	memcpy(item_val(item), val, val_size);
 	kv->tab.entries[pos].item = item;
+	feed_record(&kv->feed, KV_OP_SET, key, key_size, val, val_size);
 	return item;
 }
 
+/* Changes value size of item at slot keeping value prefix. Grown item gets
+ * half of value size as spare room, so repeated appends are amortized.
+ * Shared item is copied, as is small item which needs big layout. */
+static hash_item*
+kv_resize_val(inmemory_kv *kv, kv_slot* slot, hash_item* item, kv_len val_size) {
+	hash_entry* e = &kv->tab.entries[slot->pos];
+	kv_ns* ns = kv_key_ns(kv, item_key(item));
+	kv_len key_size = item_key_size(item);
+	kv_len old_val_size = item_val_size(item);
+	int big = item->big || item_need_big(key_size, val_size);
+	size_t head = big ? offsetof(hash_item, kind.big.key) : offsetof(hash_item, kind.small.key);
+	size_t need = head + key_size + val_size;
+	size_t have = item_size(item);
+	size_t spare = val_size > old_val_size ? val_size / 2 : 0;
+	hash_item* new_item;
+
+	if (big == item->big && entry_exclusive(e)) {
+		if (need > have || need < have / 4) {
+			new_item = item_realloc(item, need + spare);
+			if (new_item == NULL)
+				return NULL;
+			item = new_item;
+			kv->total_size += item_size(item) - have;
+			if (ns) ns->data_size += item_size(item) - have;
+			e->item = item;
+		}
+		item_set_val_size(item, val_size);
+		return item;
+	}
+	new_item = item_realloc(NULL, need + spare);
+	if (new_item == NULL)
+		return NULL;
+	new_item->pos = slot->pos;
+	new_item->big = big;
+	if (big) {
+		new_item->kind.big.key_size = key_size;
+		new_item->kind.big.val_size = val_size;
+	} else {
+		new_item->kind.small.key_size = key_size;
+		new_item->kind.small.val_size = val_size;
+	}
+	memcpy(item_key(new_item), item_key(item),
+			key_size + (val_size < old_val_size ? val_size : old_val_size));
+	kv->total_size += item_size(new_item) - have;
+	if (ns) ns->data_size += item_size(new_item) - have;
+	item_release(item, entry_shared(e));
+	e->item = new_item;
+	return new_item;
+}
+
+/* Edits value of item at slot (or creates it) in place:
+ * APPEND/PREPEND add data, SETRANGE writes data at off, TRUNCATE sets value
+ * size to off. Gap past old value end is zero filled. */
+enum { EDIT_APPEND, EDIT_PREPEND, EDIT_SETRANGE, EDIT_TRUNCATE };
+enum { EDIT_OK, EDIT_NOMEM, EDIT_TOO_BIG };
+
+static int
+kv_edit(inmemory_kv *kv, kv_slot* slot, hash_item* item, const char* key, kv_len key_size, int op, u64 off, const char* data, kv_len size, hash_item** res) {
+	kv_len old_val_size;
+	u64 new_val_size;
+	char* val;
+	if (op == EDIT_APPEND || op == EDIT_PREPEND)
+		off = 0;
+	if (op == EDIT_TRUNCATE)
+		size = 0;
+	/* key_size and size are at most KV_LEN_MAX, so checks can't wrap */
+	if (off > KV_LEN_MAX - key_size || size > KV_LEN_MAX - key_size - off)
+		return EDIT_TOO_BIG;
+	if (item == NULL) {
+		item = kv_write(kv, slot, NULL, key, key_size, data, off ? 0 : size);
+		*res = item;
+		if (item == NULL)
+			return EDIT_NOMEM;
+		if (op == EDIT_APPEND || op == EDIT_PREPEND || (off == 0 && op == EDIT_SETRANGE))
+			return EDIT_OK;
+	}
+	old_val_size = item_val_size(item);
+	switch (op) {
+	case EDIT_APPEND:
+	case EDIT_PREPEND:
+		if (size > KV_LEN_MAX - key_size - old_val_size)
+			return EDIT_TOO_BIG;
+		new_val_size = (u64)old_val_size + size;
+		break;
+	case EDIT_SETRANGE:
+		new_val_size = off + size > old_val_size ? off + size : old_val_size;
+		break;
+	default:
+		new_val_size = off;
+	}
+	hash_up(&kv->tab, kv_ns_lru(kv, kv_key_ns(kv, key)), slot->pos);
+	if (new_val_size != old_val_size ||
+			!entry_exclusive(&kv->tab.entries[slot->pos])) {
+		item = kv_resize_val(kv, slot, item, new_val_size);
+		if (item == NULL)
+			return EDIT_NOMEM;
+	}
+	val = item_val(item);
+	switch (op) {
+	case EDIT_APPEND:
+		memcpy(val + old_val_size, data, size);
+		break;
+	case EDIT_PREPEND:
+		memmove(val + size, val, old_val_size);
+		memcpy(val, data, size);
+		break;
+	default:
+		if (off > old_val_size)
+			memset(val + old_val_size, 0, off - old_val_size);
+		if (size)
+			memcpy(val + off, data, size);
+	}
+	feed_record_edit(&kv->feed, key, key_size, op, off, data, size);
+	*res = item;
+	return EDIT_OK;
+}
+
 static hash_item*
-kv_fetch(inmemory_kv *kv, const char* key, u32 key_size) {
-	u32 hash = kv_hash(key, key_size);
-	u32 pos;
+kv_insert(inmemory_kv *kv, const char* key, kv_len key_size, const char* val, kv_len val_size) {
+	kv_slot slot;
+	hash_item* item = kv_lookup(kv, key, key_size, &slot);
+	return kv_write(kv, &slot, item, key, key_size, val, val_size);
+}
+
+/* lookup without sampling */
+static hash_item*
+kv_find(inmemory_kv *kv, kv_hval hash, const char* key, kv_len key_size) {
+	kv_pos pos;
 	hash_item* item;
 	pos = hash_hash_first(&kv->tab, hash);
 	while (pos != end) {
-		item = kv->tab.entries[pos].item;
+		item = entry_item(&kv->tab.entries[pos]);
 		if (item_key_size(item) == key_size &&
 				memcmp(key, item_key(item), key_size) == 0) {
 			break;
 		}
 		pos = hash_hash_next(&kv->tab, hash, pos);
 	}
-	return pos == end ? NULL : kv->tab.entries[pos].item;
+	return pos == end ? NULL : entry_item(&kv->tab.entries[pos]);
+}
+
+static hash_item*
+kv_fetch(inmemory_kv *kv, const char* key, kv_len key_size) {
+	kv_hval hash = kv_hash(key, key_size);
+	kv_sample(kv, hash, key, key_size);
+	return kv_find(kv, hash, key, key_size);
 }
 
 static void
 kv_up(inmemory_kv *kv, hash_item* item) {
-	hash_up(&kv->tab, item->pos);
+	hash_up(&kv->tab, kv_ns_lru(kv, kv_key_ns(kv, item_key(item))), item->pos);
+	feed_record(&kv->feed, KV_OP_UP, item_key(item), item_key_size(item), NULL, 0);
 }
 
 static void
 kv_down(inmemory_kv *kv, hash_item* item) {
-	hash_down(&kv->tab, item->pos);
+	hash_down(&kv->tab, kv_ns_lru(kv, kv_key_ns(kv, item_key(item))), item->pos);
+	feed_record(&kv->feed, KV_OP_DOWN, item_key(item), item_key_size(item), NULL, 0);
 }
 
 static void
-kv_delete(inmemory_kv *kv, hash_item* item) {
-	hash_delete(&kv->tab, item->pos);
+kv_delete_at(inmemory_kv *kv, kv_slot* slot, hash_item* item) {
+	kv_ns* ns = kv_key_ns(kv, item_key(item));
+	int shared = entry_shared(&kv->tab.entries[slot->pos]);
+	feed_record(&kv->feed, KV_OP_DELETE, item_key(item), item_key_size(item), NULL, 0);
+	hash_delete_at(&kv->tab, kv_ns_lru(kv, ns), slot->pos, slot->prev);
+	slot->pos = end;
+	kv->gen++;
 	kv->total_size -= item_size(item);
-	if (item->rc > 0) {
-		item->rc--;
-	} else {
-		free(item);
+	if (ns) {
+		ns->size--;
+		ns->data_size -= item_size(item);
 	}
+	item_release(item, shared);
+}
+
+static void
+kv_delete(inmemory_kv *kv, hash_item* item) {
+	kv_slot slot;
+	slot.hash = kv->tab.entries[item->pos].hash;
+	slot.pos = item->pos;
+	slot.prev = hash_chain_prev(&kv->tab, item->pos);
+	kv_delete_at(kv, &slot, item);
 }
 
 static hash_item*
-kv_first(inmemory_kv *kv) {
-	u32 pos = hash_first(&kv->tab);
+kv_first_in(inmemory_kv *kv, hash_list* lst) {
+	kv_pos pos = hash_first(lst);
 	if (pos != end) {
-		return kv->tab.entries[pos].item;
+		return entry_item(&kv->tab.entries[pos]);
 	}
 	return NULL;
 }
 
+static hash_item*
+kv_first(inmemory_kv *kv) {
+	return kv_first_in(kv, &kv->tab.lru);
+}
+
 static void
-kv_each(inmemory_kv *kv, kv_each_cb cb, void* arg) {
-	u32 pos = hash_first(&kv->tab);
+kv_each_in(inmemory_kv *kv, hash_list* lst, kv_each_cb cb, void* arg) {
+	kv_pos pos = hash_first(lst);
 	while (pos != end) {
-		cb(kv->tab.entries[pos].item, arg);
+		cb(entry_item(&kv->tab.entries[pos]), arg);
 		pos = hash_next(&kv->tab, pos);
 	}
 }
 
 static void
-kv_destroy(inmemory_kv *kv) {
-	u32 i;
-	for (i=0; i<kv->tab.alloced; i++) {
-		if (kv->tab.entries[i].item != NULL) {
-			hash_item* item = kv->tab.entries[i].item;
-			if (item->rc > 0) {
-				item->rc--;
-			} else {
-				free(item);
-			}
+kv_each(inmemory_kv *kv, kv_each_cb cb, void* arg) {
+	kv_each_in(kv, &kv->tab.lru, cb, arg);
+}
+
+static void
+kv_destroy_chunk(kv_pos from, kv_pos to, void* arg) {
+	hash_entry* entries = arg;
+	kv_pos i;
+	for (i=from; i<to; i++) {
+		hash_entry* e = &entries[i];
+		if (e->item != NULL) {
+			item_release(entry_item(e), entry_shared(e));
 		}
 	}
+}
+
+static void
+kv_destroy(inmemory_kv *kv) {
+	kv_parallel(kv->tab.alloced, kv_destroy_chunk, kv->tab.entries);
 	hash_destroy(&kv->tab);
 }
 
+/* hands entries to lazy free thread, falls back to kv_destroy */
+static void
+kv_destroy_lazy(inmemory_kv *kv) {
+	if (kv->tab.alloced == 0 ||
+			!lazy_free_entries(kv->tab.entries, kv->tab.alloced)) {
+		kv_destroy(kv);
+		return;
+	}
+	free(kv->tab.buckets);
+}
+
+static void
+kv_clear(inmemory_kv *kv, int lazy) {
+	u32 i;
+	if (lazy)
+		kv_destroy_lazy(kv);
+	else
+		kv_destroy(kv);
+	memset(&kv->tab, 0, sizeof(kv->tab));
+	kv->total_size = 0;
+	kv->gen++;
+	for (i = 0; i < kv->ns_alloced; i++) {
+		memset(&kv->ns[i].lru, 0, sizeof(hash_list));
+		kv->ns[i].size = 0;
+		kv->ns[i].data_size = 0;
+	}
+	feed_record(&kv->feed, KV_OP_CLEAR, NULL, 0, NULL, 0);
+}
+
+struct kv_copy_arg {
+	hash_table* from;
+	hash_entry* entries;
+	kv_pos* buckets;
+	size_t added;
+};
+
+/* marks chunk of entries shared and copies it with proportional part of
+ * buckets, item_refs.lock is held by caller */
 static void
+kv_copy_chunk(kv_pos lo, kv_pos hi, void* arg) {
+	struct kv_copy_arg* a = arg;
+	hash_table* from = a->from;
+	size_t added = 0;
+	kv_pos i, blo, bhi;
+	for (i=lo; i<hi; i++) {
+		hash_entry* e = &from->entries[i];
+		if (e->item != NULL) {
+			added += item_ref_inc(entry_item(e));
+			entry_set_shared(e);
+		}
+	}
+	memcpy(a->entries + lo, from->entries + lo, sizeof(hash_entry)*(hi - lo));
+	blo = (kv_wide)from->nbuckets * lo / from->alloced;
+	bhi = (kv_wide)from->nbuckets * hi / from->alloced;
+	memcpy(a->buckets + blo, from->buckets + blo, sizeof(kv_pos)*(bhi - blo));
+	__atomic_add_fetch(&a->added, added, __ATOMIC_RELAXED);
+}
+
+/* returns 0 and leaves `to` empty if could not malloc */
+static int
 kv_copy_to(inmemory_kv *from, inmemory_kv *to) {
+	kv_feed feed = to->feed;
+	kv_sampler* sampler = to->sampler;
+	kv_ns* ns = to->ns;
+	u32 ns_alloced = to->ns_alloced;
+	u32 gen = to->gen + 1;
+	hash_entry* entries = NULL;
+	kv_pos* buckets = NULL;
+	struct kv_copy_arg copy;
 	kv_destroy(to);
-	*to = *from;
-	if (to->tab.alloced) {
-		u32 i;
-		to->tab.entries = malloc(to->tab.alloced*sizeof(hash_entry));
-		memcpy(to->tab.entries, from->tab.entries,
-				sizeof(hash_entry)*to->tab.alloced);
-		to->tab.buckets = malloc(to->tab.nbuckets*sizeof(u32));
-		memcpy(to->tab.buckets, from->tab.buckets,
-				sizeof(u32)*from->tab.nbuckets);
-		for (i=0; i<to->tab.alloced; i++) {
-			if (to->tab.entries[i].item != NULL) {
-				to->tab.entries[i].item->rc++;
-			}
+	memset(to, 0, sizeof(*to));
+	to->feed = feed;
+	to->sampler = sampler;
+	to->ns = ns;
+	to->ns_alloced = ns_alloced;
+	to->gen = gen;
+	if (ns)
+		memset(ns, 0, ns_alloced*sizeof(kv_ns));
+	if (from->ns && from->ns_alloced > ns_alloced) {
+		ns = realloc(ns, from->ns_alloced*sizeof(kv_ns));
+		if (ns == NULL)
+			return 0;
+		to->ns = ns;
+		to->ns_alloced = from->ns_alloced;
+	}
+	if (from->tab.alloced) {
+		entries = malloc(from->tab.alloced*sizeof(hash_entry));
+		buckets = malloc(from->tab.nbuckets*sizeof(kv_pos));
+		pthread_mutex_lock(&item_refs.lock);
+		if (entries == NULL || buckets == NULL ||
+				!item_ref_reserve(from->tab.size)) {
+			pthread_mutex_unlock(&item_refs.lock);
+			free(entries);
+			free(buckets);
+			return 0;
 		}
+		copy.from = &from->tab;
+		copy.entries = entries;
+		copy.buckets = buckets;
+		copy.added = 0;
+		kv_parallel(from->tab.alloced, kv_copy_chunk, &copy);
+		item_refs.size += copy.added;
+		pthread_mutex_unlock(&item_refs.lock);
+	}
+	to->tab = from->tab;
+	to->tab.entries = entries;
+	to->tab.buckets = buckets;
+	to->total_size = from->total_size;
+	if (from->ns) {
+		memcpy(to->ns, from->ns, from->ns_alloced*sizeof(kv_ns));
 	}
+	return 1;
 }
 
 static size_t
 rb_kv_memsize(const void *p) {
 	if (p) {
 		const inmemory_kv* kv = p;
-		return sizeof(*kv) + kv->total_size + hash_memsize(&kv->tab);
+		return sizeof(*kv) + kv->total_size + hash_memsize(&kv->tab) +
+			kv->feed.alloced + kv->ns_alloced * sizeof(kv_ns) +
+			(kv->sampler ? offsetof(kv_sampler, hot) +
+			 kv->sampler->capacity * sizeof(kv_hot) : 0);
 	}
 	return 0;
 }
@@ -541,7 +1673,13 @@ static void
 rb_kv_destroy(void *p) {
 	if (p) {
 		inmemory_kv *kv = p;
-		kv_destroy(kv);
+		if (kv->tab.size >= LAZY_FREE_TABLE_MIN)
+			kv_destroy_lazy(kv);
+		else
+			kv_destroy(kv);
+		feed_destroy(&kv->feed);
+		sampler_free(kv->sampler);
+		free(kv->ns);
 		free(kv);
 	}
 }
@@ -550,8 +1688,27 @@ static const rb_data_type_t InMemoryKV_data_type = {
 	"InMemoryKV_C",
 	{NULL, rb_kv_destroy, rb_kv_memsize}
 };
-#define GetKV(value, pointer) \
-	TypedData_Get_Struct((value), inmemory_kv, &InMemoryKV_data_type, (pointer))
+static void
+kv_check_busy(inmemory_kv* kv) {
+	if (kv->busy)
+		rb_raise(rb_eRuntimeError, "table is busy with bulk operation");
+}
+
+#define GetKV(value, pointer) do { \
+	TypedData_Get_Struct((value), inmemory_kv, &InMemoryKV_data_type, (pointer)); \
+	kv_check_busy(pointer); \
+} while (0)
+
+/* StringValue which also refuses strings too long for item size fields */
+#define KeyValue(v) kv_check_len(StringValue(v), "key")
+#define ValValue(v) kv_check_len(StringValue(v), "value")
+
+static inline VALUE
+kv_check_len(VALUE str, const char* what) {
+	if ((size_t)RSTRING_LEN(str) > KV_LEN_MAX)
+		rb_raise(rb_eArgError, "%s is too large", what);
+	return str;
+}
 
 static VALUE
 rb_kv_alloc(VALUE klass) {
@@ -577,7 +1734,7 @@ rb_kv_get(VALUE self, VALUE vkey) {
 	hash_item* item;
 
 	GetKV(self, kv);
-	StringValue(vkey);
+	KeyValue(vkey);
 	key = RSTRING_PTR(vkey);
 	size = RSTRING_LEN(vkey);
 	item = kv_fetch(kv, key, size);
@@ -593,7 +1750,7 @@ rb_kv_up(VALUE self, VALUE vkey) {
 	hash_item* item;
 
 	GetKV(self, kv);
-	StringValue(vkey);
+	KeyValue(vkey);
 	key = RSTRING_PTR(vkey);
 	size = RSTRING_LEN(vkey);
 	item = kv_fetch(kv, key, size);
@@ -610,7 +1767,7 @@ rb_kv_down(VALUE self, VALUE vkey) {
 	hash_item* item;
 
 	GetKV(self, kv);
-	StringValue(vkey);
+	KeyValue(vkey);
 	key = RSTRING_PTR(vkey);
 	size = RSTRING_LEN(vkey);
 	item = kv_fetch(kv, key, size);
@@ -626,7 +1783,7 @@ rb_kv_include(VALUE self, VALUE vkey) {
 	size_t size;
 
 	GetKV(self, kv);
-	StringValue(vkey);
+	KeyValue(vkey);
 	key = RSTRING_PTR(vkey);
 	size = RSTRING_LEN(vkey);
 	return kv_fetch(kv, key, size) ? Qtrue : Qfalse;
@@ -639,8 +1796,8 @@ rb_kv_set(VALUE self, VALUE vkey, VALUE vval) {
 	size_t ksize, vsize;
 
 	GetKV(self, kv);
-	StringValue(vkey);
-	StringValue(vval);
+	KeyValue(vkey);
+	ValValue(vval);
 	key = RSTRING_PTR(vkey);
 	ksize = RSTRING_LEN(vkey);
 	val = RSTRING_PTR(vval);
@@ -659,16 +1816,17 @@ rb_kv_del(VALUE self, VALUE vkey) {
 	const char *key;
 	size_t size;
 	hash_item* item;
+	kv_slot slot;
 	VALUE res;
 
 	GetKV(self, kv);
-	StringValue(vkey);
+	KeyValue(vkey);
 	key = RSTRING_PTR(vkey);
 	size = RSTRING_LEN(vkey);
-	item = kv_fetch(kv, key, size);
+	item = kv_lookup(kv, key, size, &slot);
 	if (item == NULL) return Qnil;
 	res = item_val_str(item);
-	kv_delete(kv, item);
+	kv_delete_at(kv, &slot, item);
 	return res;
 }
 
@@ -709,8 +1867,8 @@ rb_kv_unshift(VALUE self, VALUE vkey, VALUE vval) {
 	hash_item* item;
 
 	GetKV(self, kv);
-	StringValue(vkey);
-	StringValue(vval);
+	KeyValue(vkey);
+	ValValue(vval);
 	key = RSTRING_PTR(vkey);
 	ksize = RSTRING_LEN(vkey);
 	val = RSTRING_PTR(vval);
@@ -725,69 +1883,254 @@ rb_kv_unshift(VALUE self, VALUE vkey, VALUE vval) {
 	return vval;
 }
 
+static inline int
+item_val_eq(hash_item* item, VALUE vval) {
+	return item_val_size(item) == (size_t)RSTRING_LEN(vval) &&
+		memcmp(item_val(item), RSTRING_PTR(vval), RSTRING_LEN(vval)) == 0;
+}
+
 static VALUE
-rb_kv_size(VALUE self) {
+rb_kv_set_if_absent(VALUE self, VALUE vkey, VALUE vval) {
 	inmemory_kv* kv;
+	hash_item* item;
+	kv_slot slot;
+
 	GetKV(self, kv);
-	return UINT2NUM(kv->tab.size);
+	KeyValue(vkey);
+	ValValue(vval);
+	item = kv_lookup(kv, RSTRING_PTR(vkey), RSTRING_LEN(vkey), &slot);
+	if (item != NULL) return Qfalse;
+	if (kv_write(kv, &slot, NULL, RSTRING_PTR(vkey), RSTRING_LEN(vkey),
+				RSTRING_PTR(vval), RSTRING_LEN(vval)) == NULL) {
+		rb_raise(rb_eNoMemError, "could not malloc");
+	}
+	return Qtrue;
 }
 
 static VALUE
-rb_kv_empty_p(VALUE self) {
+rb_kv_getset(VALUE self, VALUE vkey, VALUE vval) {
 	inmemory_kv* kv;
+	hash_item* item;
+	kv_slot slot;
+	VALUE res = Qnil;
+
 	GetKV(self, kv);
-	return kv->tab.size ? Qfalse : Qtrue;
+	KeyValue(vkey);
+	ValValue(vval);
+	item = kv_lookup(kv, RSTRING_PTR(vkey), RSTRING_LEN(vkey), &slot);
+	if (item != NULL) res = item_val_str(item);
+	if (kv_write(kv, &slot, item, RSTRING_PTR(vkey), RSTRING_LEN(vkey),
+				RSTRING_PTR(vval), RSTRING_LEN(vval)) == NULL) {
+		rb_raise(rb_eNoMemError, "could not malloc");
+	}
+	return res;
 }
 
+/* expected nil means key should be absent */
 static VALUE
-rb_kv_data_size(VALUE self) {
+rb_kv_cas(VALUE self, VALUE vkey, VALUE vexpected, VALUE vval) {
 	inmemory_kv* kv;
+	hash_item* item;
+	kv_slot slot;
+
 	GetKV(self, kv);
-	return SIZET2NUM(kv->total_size);
+	KeyValue(vkey);
+	if (!NIL_P(vexpected)) StringValue(vexpected);
+	ValValue(vval);
+	item = kv_lookup(kv, RSTRING_PTR(vkey), RSTRING_LEN(vkey), &slot);
+	if (NIL_P(vexpected) ? item != NULL : item == NULL || !item_val_eq(item, vexpected))
+		return Qfalse;
+	if (kv_write(kv, &slot, item, RSTRING_PTR(vkey), RSTRING_LEN(vkey),
+				RSTRING_PTR(vval), RSTRING_LEN(vval)) == NULL) {
+		rb_raise(rb_eNoMemError, "could not malloc");
+	}
+	return Qtrue;
+}
+
+/* Block may change table, so slot is reused only if kv->gen is the same.
+ * Item could be replaced in place without bumping gen, so it is refetched. */
+static hash_item*
+kv_relookup(inmemory_kv* kv, VALUE vkey, kv_slot* slot, u32 gen) {
+	kv_check_busy(kv);
+	if (kv->gen != gen)
+		return kv_lookup(kv, RSTRING_PTR(vkey), RSTRING_LEN(vkey), slot);
+	return slot->pos == end ? NULL : entry_item(&kv->tab.entries[slot->pos]);
 }
 
 static VALUE
-rb_kv_total_size(VALUE self) {
+rb_kv_fetch_or_store(int argc, VALUE *argv, VALUE self) {
 	inmemory_kv* kv;
+	hash_item* item;
+	kv_slot slot;
+	u32 gen;
+	VALUE vkey, vval;
+
+	rb_scan_args(argc, argv, "11", &vkey, &vval);
 	GetKV(self, kv);
-	return SIZET2NUM(rb_kv_memsize(kv));
+	vkey = rb_str_new_frozen(KeyValue(vkey));
+	item = kv_lookup(kv, RSTRING_PTR(vkey), RSTRING_LEN(vkey), &slot);
+	if (item != NULL) return item_val_str(item);
+	if (argc == 1) {
+		gen = kv->gen;
+		vval = rb_yield(vkey);
+		ValValue(vval);
+		item = kv_relookup(kv, vkey, &slot, gen);
+		/* stored by block */
+		if (item != NULL) return item_val_str(item);
+	} else {
+		ValValue(vval);
+	}
+	if (kv_write(kv, &slot, NULL, RSTRING_PTR(vkey), RSTRING_LEN(vkey),
+				RSTRING_PTR(vval), RSTRING_LEN(vval)) == NULL) {
+		rb_raise(rb_eNoMemError, "could not malloc");
+	}
+	return vval;
 }
 
-static void
-keys_i(hash_item* item, void* arg) {
-	VALUE ary = (VALUE)arg;
-	rb_ary_push(ary, item_key_str(item));
-}
+/* block gets old value or nil, returning nil deletes entry */
+static VALUE
+rb_kv_update(VALUE self, VALUE vkey) {
+	inmemory_kv* kv;
+	hash_item* item;
+	kv_slot slot;
+	u32 gen;
+	VALUE vval;
 
-static void
-vals_i(hash_item* item, void* arg) {
-	VALUE ary = (VALUE)arg;
-	rb_ary_push(ary, item_val_str(item));
+	GetKV(self, kv);
+	vkey = rb_str_new_frozen(KeyValue(vkey));
+	item = kv_lookup(kv, RSTRING_PTR(vkey), RSTRING_LEN(vkey), &slot);
+	gen = kv->gen;
+	vval = rb_yield(item ? item_val_str(item) : Qnil);
+	if (!NIL_P(vval)) ValValue(vval);
+	item = kv_relookup(kv, vkey, &slot, gen);
+	if (NIL_P(vval)) {
+		if (item != NULL) kv_delete_at(kv, &slot, item);
+		return Qnil;
+	}
+	if (kv_write(kv, &slot, item, RSTRING_PTR(vkey), RSTRING_LEN(vkey),
+				RSTRING_PTR(vval), RSTRING_LEN(vval)) == NULL) {
+		rb_raise(rb_eNoMemError, "could not malloc");
+	}
+	return vval;
 }
 
-static void
-pairs_i(hash_item* item, void* arg) {
-	VALUE ary = (VALUE)arg;
-	VALUE key, val;
-	key = item_key_str(item);
-	val = item_val_str(item);
-	rb_ary_push(ary, rb_assoc_new(key, val));
+static VALUE
+rb_kv_edit(inmemory_kv* kv, VALUE vkey, int op, u64 off, VALUE vdata, int create) {
+	hash_item* item;
+	kv_slot slot;
+	const char* data = NULL;
+	kv_len size = 0;
+	int rc;
+
+	KeyValue(vkey);
+	if (!NIL_P(vdata)) {
+		ValValue(vdata);
+		data = RSTRING_PTR(vdata);
+		size = RSTRING_LEN(vdata);
+	}
+	item = kv_lookup(kv, RSTRING_PTR(vkey), RSTRING_LEN(vkey), &slot);
+	if (item == NULL && !create) return Qnil;
+	rc = kv_edit(kv, &slot, item, RSTRING_PTR(vkey), RSTRING_LEN(vkey),
+			op, off, data, size, &item);
+	if (rc == EDIT_TOO_BIG) {
+		rb_raise(rb_eArgError, "value is too large");
+	} else if (rc == EDIT_NOMEM) {
+		rb_raise(rb_eNoMemError, "could not malloc");
+	}
+	return LEN2NUM(item_val_size(item));
 }
 
 static VALUE
-rb_kv_keys(VALUE self) {
+rb_kv_append(VALUE self, VALUE vkey, VALUE vdata) {
 	inmemory_kv* kv;
-	VALUE res;
 	GetKV(self, kv);
-	res = rb_ary_new2(kv->tab.size);
-	kv_each(kv, keys_i, (void*)res);
-	return res;
+	return rb_kv_edit(kv, vkey, EDIT_APPEND, 0, vdata, 1);
 }
 
 static VALUE
-rb_kv_vals(VALUE self) {
+rb_kv_prepend(VALUE self, VALUE vkey, VALUE vdata) {
 	inmemory_kv* kv;
-	VALUE res;
+	GetKV(self, kv);
+	return rb_kv_edit(kv, vkey, EDIT_PREPEND, 0, vdata, 1);
+}
+
+static VALUE
+rb_kv_setrange(VALUE self, VALUE vkey, VALUE voff, VALUE vdata) {
+	inmemory_kv* kv;
+	GetKV(self, kv);
+	return rb_kv_edit(kv, vkey, EDIT_SETRANGE, NUM2ULL(voff), vdata, 1);
+}
+
+static VALUE
+rb_kv_truncate(VALUE self, VALUE vkey, VALUE vlen) {
+	inmemory_kv* kv;
+	GetKV(self, kv);
+	return rb_kv_edit(kv, vkey, EDIT_TRUNCATE, NUM2ULL(vlen), Qnil, 0);
+}
+
+static VALUE
+rb_kv_size(VALUE self) {
+	inmemory_kv* kv;
+	GetKV(self, kv);
+	return POS2NUM(kv->tab.size);
+}
+
+static VALUE
+rb_kv_empty_p(VALUE self) {
+	inmemory_kv* kv;
+	GetKV(self, kv);
+	return kv->tab.size ? Qfalse : Qtrue;
+}
+
+static VALUE
+rb_kv_data_size(VALUE self) {
+	inmemory_kv* kv;
+	GetKV(self, kv);
+	return SIZET2NUM(kv->total_size);
+}
+
+static VALUE
+rb_kv_total_size(VALUE self) {
+	inmemory_kv* kv;
+	GetKV(self, kv);
+	return SIZET2NUM(rb_kv_memsize(kv));
+}
+
+static void
+keys_i(hash_item* item, void* arg) {
+	VALUE ary = (VALUE)arg;
+	rb_ary_push(ary, item_key_str(item));
+}
+
+static void
+vals_i(hash_item* item, void* arg) {
+	VALUE ary = (VALUE)arg;
+	rb_ary_push(ary, item_val_str(item));
+}
+
+static void
+pairs_i(hash_item* item, void* arg) {
+	VALUE ary = (VALUE)arg;
+	VALUE key, val;
+	key = item_key_str(item);
+	val = item_val_str(item);
+	rb_ary_push(ary, rb_assoc_new(key, val));
+}
+
+static VALUE
+rb_kv_keys(VALUE self) {
+	inmemory_kv* kv;
+	VALUE res;
+	GetKV(self, kv);
+	res = rb_ary_new2(kv->tab.size);
+	kv_each(kv, keys_i, (void*)res);
+	return res;
+}
+
+static VALUE
+rb_kv_vals(VALUE self) {
+	inmemory_kv* kv;
+	VALUE res;
 	GetKV(self, kv);
 	res = rb_ary_new2(kv->tab.size);
 	kv_each(kv, vals_i, (void*)res);
@@ -890,49 +2233,2646 @@ rb_kv_init_copy(VALUE self, VALUE orig) {
 	inmemory_kv *origin, *new;
 	GetKV(self, new);
 	GetKV(orig, origin);
-	kv_copy_to(origin, new);
+	if (!kv_copy_to(origin, new)) {
+		rb_raise(rb_eNoMemError, "could not malloc");
+	}
 	return self;
 }
 
+static int
+opt_async(VALUE opts) {
+	static ID kw;
+	VALUE val = Qundef;
+	if (NIL_P(opts)) return 0;
+	if (!kw) kw = rb_intern("async");
+	rb_get_kwargs(opts, &kw, 0, 1, &val);
+	return val != Qundef && RTEST(val);
+}
+
 static VALUE
-rb_kv_clear(VALUE self) {
+rb_kv_clear(int argc, VALUE *argv, VALUE self) {
 	inmemory_kv* kv;
+	VALUE opts;
 	GetKV(self, kv);
-	kv_destroy(kv);
-	memset(kv, 0, sizeof(*kv));
+	rb_scan_args(argc, argv, "0:", &opts);
+	kv_clear(kv, opt_async(opts));
 	return self;
 }
 
-void
-Init_inmemory_kv() {
-	VALUE mod_inmemory_kv, cls_str2str;
-	mod_inmemory_kv = rb_define_module("InMemoryKV");
-	cls_str2str = rb_define_class_under(mod_inmemory_kv, "Str2Str", rb_cObject);
-	rb_define_alloc_func(cls_str2str, rb_kv_alloc);
-	rb_define_method(cls_str2str, "[]", rb_kv_get, 1);
-	rb_define_method(cls_str2str, "up", rb_kv_up, 1);
-	rb_define_method(cls_str2str, "down", rb_kv_down, 1);
-	rb_define_method(cls_str2str, "[]=", rb_kv_set, 2);
-	rb_define_method(cls_str2str, "unshift", rb_kv_unshift, 2);
-	rb_define_method(cls_str2str, "delete", rb_kv_del, 1);
-	rb_define_method(cls_str2str, "empty?", rb_kv_empty_p, 0);
-	rb_define_method(cls_str2str, "size", rb_kv_size, 0);
-	rb_define_method(cls_str2str, "count", rb_kv_size, 0);
-	rb_define_method(cls_str2str, "data_size", rb_kv_data_size, 0);
-	rb_define_method(cls_str2str, "total_size", rb_kv_total_size, 0);
-	rb_define_method(cls_str2str, "include?", rb_kv_include, 1);
-	rb_define_method(cls_str2str, "has_key?", rb_kv_include, 1);
-	rb_define_method(cls_str2str, "first", rb_kv_first, 0);
-	rb_define_method(cls_str2str, "shift", rb_kv_shift, 0);
-	rb_define_method(cls_str2str, "keys", rb_kv_keys, 0);
-	rb_define_method(cls_str2str, "values", rb_kv_vals, 0);
-	rb_define_method(cls_str2str, "entries", rb_kv_entries, 0);
-	rb_define_method(cls_str2str, "each_key", rb_kv_each_key, 0);
-	rb_define_method(cls_str2str, "each_value", rb_kv_each_val, 0);
-	rb_define_method(cls_str2str, "each_pair", rb_kv_each, 0);
-	rb_define_method(cls_str2str, "each", rb_kv_each, 0);
-	rb_define_method(cls_str2str, "inspect", rb_kv_inspect, 0);
-	rb_define_method(cls_str2str, "initialize_copy", rb_kv_init_copy, 1);
-	rb_define_method(cls_str2str, "clear", rb_kv_clear, 0);
-	rb_include_module(cls_str2str, rb_mEnumerable);
+static VALUE
+rb_lazy_free_threshold(VALUE self) {
+	return SIZET2NUM(lazy_free.threshold);
+}
+
+static VALUE
+rb_lazy_free_set_threshold(VALUE self, VALUE size) {
+	lazy_free.threshold = NIL_P(size) ? 0 : NUM2SIZET(size);
+	return size;
+}
+
+static VALUE
+rb_parallel_threads(VALUE self) {
+	return UINT2NUM(parallel_nthreads());
+}
+
+static VALUE
+rb_parallel_set_threads(VALUE self, VALUE vthreads) {
+	u32 threads = NUM2UINT(vthreads);
+	if (threads == 0 || threads > PARALLEL_MAX_THREADS)
+		rb_raise(rb_eArgError, "threads should be in 1..%d", PARALLEL_MAX_THREADS);
+	parallel_threads = threads;
+	return vthreads;
+}
+
+static VALUE
+rb_lazy_free_pending(VALUE self) {
+	size_t pending;
+	pthread_mutex_lock(&lazy_free.lock);
+	pending = lazy_free.pending;
+	pthread_mutex_unlock(&lazy_free.lock);
+	return SIZET2NUM(pending);
+}
+
+static VALUE
+rb_kv_track_changes(int argc, VALUE *argv, VALUE self) {
+	inmemory_kv* kv;
+	VALUE on;
+	GetKV(self, kv);
+	rb_scan_args(argc, argv, "01", &on);
+	kv->feed.on = argc == 0 || RTEST(on);
+	if (!kv->feed.on) {
+		feed_destroy(&kv->feed);
+		kv->feed.lost = 0;
+	}
+	return self;
+}
+
+static VALUE
+rb_kv_tracking_changes_p(VALUE self) {
+	inmemory_kv* kv;
+	GetKV(self, kv);
+	return kv->feed.on ? Qtrue : Qfalse;
+}
+
+static VALUE
+rb_kv_change_seq(VALUE self) {
+	inmemory_kv* kv;
+	GetKV(self, kv);
+	return ULL2NUM(kv->feed.seq);
+}
+
+static VALUE
+rb_kv_applied_seq(VALUE self) {
+	inmemory_kv* kv;
+	GetKV(self, kv);
+	return ULL2NUM(kv->feed.applied);
+}
+
+static VALUE
+rb_kv_snapshot_pending_p(VALUE self) {
+	inmemory_kv* kv;
+	GetKV(self, kv);
+	return kv->feed.snap_left ? Qtrue : Qfalse;
+}
+
+static VALUE
+rb_kv_take_changes(VALUE self) {
+	inmemory_kv* kv;
+	VALUE res;
+	GetKV(self, kv);
+	if (kv->feed.lost) {
+		feed_destroy(&kv->feed);
+		kv->feed.lost = 0;
+		rb_raise(rb_eNoMemError, "could not malloc, change feed lost records");
+	}
+	res = rb_str_new(kv->feed.buf, kv->feed.len);
+	if (kv->feed.alloced > (1 << 20)) {
+		feed_destroy(&kv->feed);
+	} else {
+		kv->feed.len = 0;
+	}
+	return res;
+}
+
+struct snapshot_arg {
+	char* p;
+};
+static void
+snapshot_i(hash_item* item, void* arg) {
+	struct snapshot_arg* a = arg;
+	a->p = feed_put_str(a->p, item_key(item), item_key_size(item));
+	a->p = feed_put_str(a->p, item_val(item), item_val_size(item));
+}
+
+static VALUE
+rb_kv_snapshot(VALUE self) {
+	inmemory_kv* kv;
+	struct snapshot_arg a;
+	VALUE res;
+	char* start;
+	GetKV(self, kv);
+	res = rb_str_new(NULL, 1 + 10 + 10 + kv->total_size + (size_t)kv->tab.size * 10);
+	start = a.p = RSTRING_PTR(res);
+	*a.p++ = KV_OP_SNAPSHOT;
+	a.p = feed_put_varint(a.p, kv->feed.seq);
+	a.p = feed_put_varint(a.p, kv->tab.size);
+	kv_each(kv, snapshot_i, &a);
+	rb_str_set_len(res, a.p - start);
+	return res;
+}
+
+NORETURN(static void feed_corrupted(void));
+static void
+feed_corrupted(void) {
+	rb_raise(rb_eArgError, "corrupted change feed");
+}
+
+/* Snapshot clears table once its head is read, then its pairs are applied
+ * as they arrive, so big snapshot is not reparsed for every chunk. */
+static VALUE
+rb_kv_apply_changes(VALUE self, VALUE vbuf) {
+	inmemory_kv* kv;
+	const char *start, *end, *p, *r, *key = NULL, *val = NULL;
+	kv_len key_size = 0, val_size = 0;
+	u64 seq = 0, count = 0, off = 0;
+	hash_item* item;
+	kv_slot slot;
+	int op, kind = 0, bad = 0;
+
+	GetKV(self, kv);
+	StringValue(vbuf);
+	start = p = RSTRING_PTR(vbuf);
+	end = start + RSTRING_LEN(vbuf);
+	while (p < end) {
+		if (kv->feed.snap_left) {
+			r = feed_get_str(p, end, &key, &key_size, &bad);
+			if (r != NULL)
+				r = feed_get_str(r, end, &val, &val_size, &bad);
+			if (bad) feed_corrupted();
+			if (r == NULL) break;
+			if (kv_insert(kv, key, key_size, val, val_size) == NULL) {
+				rb_raise(rb_eNoMemError, "could not malloc");
+			}
+			if (--kv->feed.snap_left == 0)
+				kv->feed.applied = kv->feed.snap_seq;
+			p = r;
+			continue;
+		}
+		op = (u8)*p;
+		if (op < KV_OP_SET || op > KV_OP_EDIT)
+			feed_corrupted();
+		r = feed_get_varint(p + 1, end, &seq, &bad);
+		if (r != NULL && op == KV_OP_SNAPSHOT) {
+			r = feed_get_varint(r, end, &count, &bad);
+		} else if (r != NULL && op != KV_OP_CLEAR) {
+			r = feed_get_str(r, end, &key, &key_size, &bad);
+			if (r != NULL && op == KV_OP_SET)
+				r = feed_get_str(r, end, &val, &val_size, &bad);
+			if (r != NULL && op == KV_OP_EDIT) {
+				if (r == end) {
+					r = NULL;
+				} else if ((kind = (u8)*r++) > EDIT_TRUNCATE) {
+					feed_corrupted();
+				} else {
+					r = feed_get_varint(r, end, &off, &bad);
+					if (r != NULL)
+						r = feed_get_str(r, end, &val, &val_size, &bad);
+				}
+			}
+		}
+		if (bad) feed_corrupted();
+		if (r == NULL) break;
+		if (op == KV_OP_SNAPSHOT) {
+			kv_clear(kv, 1);
+			kv->feed.snap_left = count;
+			kv->feed.snap_seq = seq;
+			if (count == 0)
+				kv->feed.applied = seq;
+		} else if (seq > kv->feed.applied) {
+			switch (op) {
+			case KV_OP_SET:
+				if (kv_insert(kv, key, key_size, val, val_size) == NULL) {
+					rb_raise(rb_eNoMemError, "could not malloc");
+				}
+				break;
+			case KV_OP_CLEAR:
+				kv_clear(kv, 1);
+				break;
+			case KV_OP_EDIT:
+				item = kv_lookup(kv, key, key_size, &slot);
+				if (item == NULL && kind == EDIT_TRUNCATE)
+					break;
+				switch (kv_edit(kv, &slot, item, key, key_size, kind, off, val, val_size, &item)) {
+				case EDIT_TOO_BIG:
+					feed_corrupted();
+				case EDIT_NOMEM:
+					rb_raise(rb_eNoMemError, "could not malloc");
+				}
+				break;
+			default:
+				item = kv_lookup(kv, key, key_size, &slot);
+				if (item == NULL)
+					break;
+				if (op == KV_OP_DELETE)
+					kv_delete_at(kv, &slot, item);
+				else if (op == KV_OP_UP)
+					kv_up(kv, item);
+				else
+					kv_down(kv, item);
+			}
+			kv->feed.applied = seq;
+		}
+		p = r;
+	}
+	return SIZET2NUM(p - start);
+}
+
+static VALUE
+rb_kv_track_hot_keys(int argc, VALUE *argv, VALUE self) {
+	inmemory_kv* kv;
+	kv_sampler* sampler = NULL;
+	u32 rate = 64, capacity = 128;
+	VALUE vrate, vcapacity;
+	GetKV(self, kv);
+	rb_scan_args(argc, argv, "02", &vrate, &vcapacity);
+	if (argc == 0 || RTEST(vrate)) {
+		if (!NIL_P(vrate)) rate = NUM2UINT(vrate);
+		if (!NIL_P(vcapacity)) capacity = NUM2UINT(vcapacity);
+		if (rate == 0 || rate > SAMPLER_RATE_MAX)
+			rb_raise(rb_eArgError, "rate should be in 1..%d", SAMPLER_RATE_MAX);
+		if (capacity == 0 || capacity > 65536)
+			rb_raise(rb_eArgError, "capacity should be in 1..65536");
+		sampler = sampler_new(rate, capacity);
+		if (sampler == NULL)
+			rb_raise(rb_eNoMemError, "could not malloc");
+	}
+	sampler_free(kv->sampler);
+	kv->sampler = sampler;
+	return self;
+}
+
+static VALUE
+rb_kv_tracking_hot_keys_p(VALUE self) {
+	inmemory_kv* kv;
+	GetKV(self, kv);
+	return kv->sampler ? Qtrue : Qfalse;
+}
+
+static VALUE
+rb_kv_reset_hot_keys(VALUE self) {
+	inmemory_kv* kv;
+	GetKV(self, kv);
+	if (kv->sampler) sampler_reset(kv->sampler);
+	return self;
+}
+
+static int
+hot_cmp(const void* a, const void* b) {
+	const kv_hot* x = *(const kv_hot**)a;
+	const kv_hot* y = *(const kv_hot**)b;
+	return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+static VALUE
+hot_entry(VALUE key, u64 freq, hash_item* item) {
+	return rb_ary_new3(3, key, freq == (u64)-1 ? Qnil : ULL2NUM(freq),
+			item ? SIZET2NUM(item_size(item)) : Qnil);
+}
+
+/* [[key, estimated lookups, item size]] by estimated lookups */
+static VALUE
+rb_kv_hot_keys(int argc, VALUE *argv, VALUE self) {
+	inmemory_kv* kv;
+	kv_sampler* sm;
+	kv_hot** hot;
+	u32 i, k = 10;
+	VALUE vk, res, tmp;
+	GetKV(self, kv);
+	rb_scan_args(argc, argv, "01", &vk);
+	if (!NIL_P(vk)) k = NUM2UINT(vk);
+	res = rb_ary_new();
+	sm = kv->sampler;
+	if (sm == NULL || sm->used == 0)
+		return res;
+	hot = ALLOCV_N(kv_hot*, tmp, sm->used);
+	for (i = 0; i < sm->used; i++)
+		hot[i] = &sm->hot[i];
+	qsort(hot, sm->used, sizeof(kv_hot*), hot_cmp);
+	if (k > sm->used) k = sm->used;
+	for (i = 0; i < k; i++) {
+		kv_hot* h = hot[i];
+		rb_ary_push(res, hot_entry(rb_str_new(h->key, h->key_size),
+					h->count * sm->rate,
+					kv_find(kv, h->hash, h->key, h->key_size)));
+	}
+	ALLOCV_END(tmp);
+	return res;
+}
+
+/* [[key, estimated lookups, item size]] by item size, scans whole table;
+ * lookups are nil if hot keys are not tracked */
+/* top is min-heap by item size, so scan is O(n log k): item replaces
+ * root and sinks to its place */
+static void
+largest_sift(hash_item** top, u32 n, hash_item* item) {
+	u32 i = 0, c;
+	while ((c = 2*i + 1) < n) {
+		if (c + 1 < n && item_size(top[c+1]) < item_size(top[c]))
+			c++;
+		if (item_size(top[c]) >= item_size(item))
+			break;
+		top[i] = top[c];
+		i = c;
+	}
+	top[i] = item;
+}
+
+static VALUE
+rb_kv_largest_items(int argc, VALUE *argv, VALUE self) {
+	inmemory_kv* kv;
+	hash_item** top;
+	hash_item* item;
+	kv_hot* h;
+	u32 i, j, n = 0, k = 10;
+	u64 freq;
+	VALUE vk, res, tmp;
+	GetKV(self, kv);
+	rb_scan_args(argc, argv, "01", &vk);
+	if (!NIL_P(vk)) k = NUM2UINT(vk);
+	if (k > kv->tab.size) k = kv->tab.size;
+	res = rb_ary_new();
+	if (k == 0)
+		return res;
+	top = ALLOCV_N(hash_item*, tmp, k);
+	for (i = 0; i < kv->tab.alloced; i++) {
+		if (kv->tab.entries[i].item == NULL)
+			continue;
+		item = entry_item(&kv->tab.entries[i]);
+		if (n < k) {
+			for (j = n++; j > 0 && item_size(top[(j-1)/2]) > item_size(item); j = (j-1)/2)
+				top[j] = top[(j-1)/2];
+			top[j] = item;
+		} else if (item_size(top[0]) < item_size(item)) {
+			largest_sift(top, n, item);
+		}
+	}
+	/* heap sort: smallest is moved to the end, so result is descending */
+	for (i = n; i > 1; i--) {
+		item = top[i-1];
+		top[i-1] = top[0];
+		largest_sift(top, i-1, item);
+	}
+	for (i = 0; i < n; i++) {
+		item = top[i];
+		freq = (u64)-1;
+		if (kv->sampler) {
+			h = sampler_find(kv->sampler, kv->tab.entries[item->pos].hash,
+					item_key(item), item_key_size(item));
+			freq = h ? h->count * kv->sampler->rate : 0;
+		}
+		rb_ary_push(res, hot_entry(item_key_str(item), freq, item));
+	}
+	ALLOCV_END(tmp);
+	return res;
+}
+
+static VALUE
+rb_kv_reserve(VALUE self, VALUE vsize) {
+	inmemory_kv* kv;
+	GetKV(self, kv);
+	/* NUM2POS wraps negative numbers into huge counts */
+	vsize = rb_to_int(vsize);
+	if (RTEST(rb_funcall(vsize, '<', 1, INT2FIX(0))))
+		rb_raise(rb_eArgError, "count is negative");
+	if (RTEST(rb_funcall(vsize, '>', 1, POS2NUM(KV_POS_MAX))))
+		rb_raise(rb_eArgError, "count is too large");
+	if (!hash_reserve(&kv->tab, NUM2POS(vsize))) {
+		rb_raise(rb_eNoMemError, "could not malloc");
+	}
+	kv->gen++;
+	return self;
+}
+
+enum { BULK_TSV, BULK_LENGTH_PREFIXED };
+enum { BULK_OK, BULK_NOMEM, BULK_BAD };
+
+struct bulk_load_arg {
+	inmemory_kv* kv;
+	VALUE str;
+	const char* p;
+	const char* end;
+	int format;
+	int final;
+	volatile int cancel;
+	int error;
+	size_t loaded;
+};
+
+static inline u32
+get_u32_le(const char* p) {
+	const u8* b = (const u8*)p;
+	return b[0] | (b[1] << 8) | (b[2] << 16) | ((u32)b[3] << 24);
+}
+
+/* runs without GVL, stops at first incomplete record unless it is final */
+static void*
+kv_bulk_load(void* arg) {
+	struct bulk_load_arg* a = arg;
+	const char *p = a->p, *end = a->end;
+	const char *key, *val, *next;
+	size_t key_size, val_size;
+	while (p < end && !a->cancel) {
+		if (a->format == BULK_TSV) {
+			const char *nl, *tab;
+			nl = memchr(p, '\n', end - p);
+			if (nl == NULL && !a->final)
+				break;
+			next = nl ? nl + 1 : end;
+			if (nl == NULL) nl = end;
+			if (nl > p && nl[-1] == '\r') nl--;
+			if (nl == p) {
+				p = next;
+				continue;
+			}
+			tab = memchr(p, '\t', nl - p);
+			if (tab == NULL) {
+				a->error = BULK_BAD;
+				break;
+			}
+			key = p;
+			key_size = tab - p;
+			val = tab + 1;
+			val_size = nl - val;
+		} else {
+			if (end - p < 8) {
+				if (a->final) a->error = BULK_BAD;
+				break;
+			}
+			key_size = get_u32_le(p);
+			val_size = get_u32_le(p + 4);
+			if ((size_t)(end - p - 8) < key_size + val_size) {
+				if (a->final) a->error = BULK_BAD;
+				break;
+			}
+			key = p + 8;
+			val = key + key_size;
+			next = val + val_size;
+		}
+		if (key_size > KV_LEN_MAX || val_size > KV_LEN_MAX) {
+			a->error = BULK_BAD;
+			break;
+		}
+		if (kv_insert(a->kv, key, key_size, val, val_size) == NULL) {
+			a->error = BULK_NOMEM;
+			break;
+		}
+		a->loaded++;
+		p = next;
+	}
+	a->p = p;
+	return NULL;
+}
+
+static void
+bulk_load_cancel(void* arg) {
+	struct bulk_load_arg* a = arg;
+	a->cancel = 1;
+}
+
+static VALUE
+bulk_load_body(VALUE arg) {
+	struct bulk_load_arg* a = (struct bulk_load_arg*)arg;
+	rb_thread_call_without_gvl(kv_bulk_load, a, bulk_load_cancel, a);
+	return Qnil;
+}
+
+static VALUE
+bulk_load_ensure(VALUE arg) {
+	struct bulk_load_arg* a = (struct bulk_load_arg*)arg;
+	a->kv->busy = 0;
+	rb_str_unlocktmp(a->str);
+	return Qnil;
+}
+
+/* returns [consumed bytes, loaded records] */
+static VALUE
+rb_kv_bulk_load_chunk(VALUE self, VALUE vstr, VALUE vformat, VALUE vfinal) {
+	inmemory_kv* kv;
+	struct bulk_load_arg a;
+	const char* start;
+
+	GetKV(self, kv);
+	StringValue(vstr);
+	memset(&a, 0, sizeof(a));
+	if (SYM2ID(vformat) == rb_intern("tsv")) {
+		a.format = BULK_TSV;
+	} else if (SYM2ID(vformat) == rb_intern("length_prefixed")) {
+		a.format = BULK_LENGTH_PREFIXED;
+	} else {
+		rb_raise(rb_eArgError, "unknown format %"PRIsVALUE, vformat);
+	}
+	a.kv = kv;
+	a.str = vstr;
+	a.final = RTEST(vfinal);
+	start = a.p = RSTRING_PTR(vstr);
+	a.end = a.p + RSTRING_LEN(vstr);
+	rb_str_locktmp(vstr);
+	kv->busy = 1;
+	rb_ensure(bulk_load_body, (VALUE)&a, bulk_load_ensure, (VALUE)&a);
+	if (a.error == BULK_NOMEM) {
+		rb_raise(rb_eNoMemError, "could not malloc");
+	} else if (a.error == BULK_BAD) {
+		rb_raise(rb_eArgError, "malformed record at offset %"PRIuSIZE, (size_t)(a.p - start));
+	}
+	rb_thread_check_ints();
+	return rb_assoc_new(SIZET2NUM(a.p - start), SIZET2NUM(a.loaded));
+}
+
+/* Frozen: immutable read-only form of Str2Str kept in one contiguous blob,
+ * so it could be saved to disk and mmapped back. Lookup uses hash and
+ * displace perfect hash: key's bucket holds displacement which sends all
+ * keys of the bucket to distinct slots, slot holds record offset. Records
+ * are kept in LRU order of source table. Blob is never written after build,
+ * so it is read without locks from any thread or Ractor.
+ *
+ * Layout: frozen_header, u32 disp[nbuckets] padded to 8 bytes,
+ * u64 slots[nslots], records {u32 key_size, u32 val_size, key, val}.
+ * Numbers are in host byte order, so bom rejects blob of other endianness. */
+#define FROZEN_MAGIC "IMKVCHD1"
+#define FROZEN_BOM 0x01020304
+#define FROZEN_EMPTY ((u64)0 - 1)
+#define FROZEN_BUCKET_KEYS 4
+#define FROZEN_MAX_DISP (1 << 20)
+#define FROZEN_SEEDS 16
+/* nslots = count + count/20 + 1 has to fit u32 */
+#define FROZEN_MAX_COUNT (((u32)0 - 1) / 21 * 20)
+#define FROZEN_MAX_LEN ((u32)0 - 1)
+
+typedef struct frozen_header {
+	char magic[8];
+	u32 bom;
+	u32 count;
+	u32 nbuckets;
+	u32 nslots;
+	u64 seed;
+	u64 data_size;
+} frozen_header;
+
+typedef struct kv_frozen {
+	char* blob;
+	size_t size;
+	int mmapped;
+	const frozen_header* hdr;
+	const u32* disp;
+	const u64* slots;
+	const char* data;
+} kv_frozen;
+
+static inline u64
+frozen_mix(u64 h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/* stable across processes unlike kv_hash, as blob could be saved */
+static u64
+frozen_hash(const char* key, size_t size, u64 seed) {
+	u64 h = seed ^ ((u64)size * 0x9e3779b97f4a7c15ULL);
+	u64 k;
+	while (size >= 8) {
+		memcpy(&k, key, 8);
+		h = (h ^ frozen_mix(k)) * 0x9e3779b97f4a7c15ULL;
+		key += 8;
+		size -= 8;
+	}
+	k = 0;
+	memcpy(&k, key, size);
+	return frozen_mix(h ^ k);
+}
+
+static inline u32
+frozen_bucket(u64 h, u32 nbuckets) {
+	return (u32)(h >> 32) % nbuckets;
+}
+
+static inline u32
+frozen_slot(u64 h, u32 d, u32 nslots) {
+	return frozen_mix(h + d * 0x9e3779b97f4a7c15ULL) % nslots;
+}
+
+static inline size_t
+frozen_head_size(u32 nbuckets, u32 nslots) {
+	return ((sizeof(frozen_header) + (size_t)nbuckets*sizeof(u32) + 7) & ~(size_t)7) +
+		(size_t)nslots*sizeof(u64);
+}
+
+static void
+frozen_init(kv_frozen* fz, char* blob, size_t size) {
+	fz->blob = blob;
+	fz->size = size;
+	fz->hdr = (const frozen_header*)blob;
+	fz->disp = (const u32*)(blob + sizeof(frozen_header));
+	fz->slots = (const u64*)(blob + frozen_head_size(fz->hdr->nbuckets, 0));
+	fz->data = blob + frozen_head_size(fz->hdr->nbuckets, fz->hdr->nslots);
+}
+
+/* checks header only, records are bounds checked on access,
+ * so mmapped file is not read as a whole */
+static int
+frozen_valid(const char* blob, size_t size) {
+	const frozen_header* hdr = (const frozen_header*)blob;
+	if (size < sizeof(frozen_header) ||
+			memcmp(hdr->magic, FROZEN_MAGIC, 8) != 0 ||
+			hdr->bom != FROZEN_BOM ||
+			hdr->nbuckets == 0 || hdr->nslots == 0)
+		return 0;
+	if (frozen_head_size(hdr->nbuckets, hdr->nslots) > size)
+		return 0;
+	return hdr->data_size == size - frozen_head_size(hdr->nbuckets, hdr->nslots);
+}
+
+static const char*
+frozen_get(const kv_frozen* fz, const char* key, size_t key_size, u32* val_size) {
+	const frozen_header* hdr = fz->hdr;
+	const char* rec;
+	u64 h, off;
+	u32 ks, vs;
+	if (hdr->count == 0)
+		return NULL;
+	h = frozen_hash(key, key_size, hdr->seed);
+	off = fz->slots[frozen_slot(h, fz->disp[frozen_bucket(h, hdr->nbuckets)], hdr->nslots)];
+	if (off == FROZEN_EMPTY || hdr->data_size < 8 || off > hdr->data_size - 8)
+		return NULL;
+	rec = fz->data + off;
+	memcpy(&ks, rec, 4);
+	memcpy(&vs, rec + 4, 4);
+	if (ks != key_size || (u64)ks + vs > hdr->data_size - off - 8 ||
+			memcmp(rec + 8, key, key_size) != 0)
+		return NULL;
+	*val_size = vs;
+	return rec + 8 + ks;
+}
+
+typedef void (*frozen_each_cb)(const char* key, u32 key_size, const char* val, u32 val_size, void* arg);
+
+static void
+frozen_each(const kv_frozen* fz, frozen_each_cb cb, void* arg) {
+	u64 off = 0, data_size = fz->hdr->data_size;
+	u32 i, ks, vs;
+	const char* rec;
+	for (i = 0; i < fz->hdr->count && data_size - off >= 8; i++) {
+		rec = fz->data + off;
+		memcpy(&ks, rec, 4);
+		memcpy(&vs, rec + 4, 4);
+		if ((u64)ks + vs > data_size - off - 8)
+			break;
+		cb(rec + 8, ks, rec + 8 + ks, vs, arg);
+		off += 8 + (u64)ks + vs;
+	}
+}
+
+enum { FROZEN_OK, FROZEN_NOMEM, FROZEN_FAILED, FROZEN_CANCEL, FROZEN_TOO_BIG };
+
+struct frozen_build {
+	inmemory_kv* kv;
+	char* blob;
+	size_t size;
+	int error;
+	volatile int cancel;
+};
+
+/* assigns displacements to buckets, largest buckets first */
+static int
+frozen_solve(struct frozen_build* b, u64* hashes, u64* offs, u32* bstart, u32* order, u32* border, u64* taken, u32* tmp) {
+	frozen_header* hdr = (frozen_header*)b->blob;
+	u32* disp = (u32*)(b->blob + sizeof(frozen_header));
+	u64* slots = (u64*)(b->blob + frozen_head_size(hdr->nbuckets, 0));
+	u32 n = hdr->count, nb = hdr->nbuckets, m = hdr->nslots;
+	u32 i, j, k, c, d, bk, s, maxc = 0;
+	const char* data = b->blob + frozen_head_size(nb, m);
+
+	memset(bstart, 0, (nb+1)*sizeof(u32));
+	for (i = 0; i < n; i++) {
+		u32 ks;
+		memcpy(&ks, data + offs[i], 4);
+		hashes[i] = frozen_hash(data + offs[i] + 8, ks, hdr->seed);
+		bstart[frozen_bucket(hashes[i], nb)+1]++;
+	}
+	for (i = 0; i < nb; i++) {
+		if (bstart[i+1] > maxc) maxc = bstart[i+1];
+		bstart[i+1] += bstart[i];
+	}
+	memcpy(border, bstart, nb*sizeof(u32));
+	for (i = 0; i < n; i++)
+		order[border[frozen_bucket(hashes[i], nb)]++] = i;
+	/* bucket order by size descending, tmp counts buckets of each size */
+	memset(tmp, 0, (maxc+2)*sizeof(u32));
+	for (i = 0; i < nb; i++)
+		tmp[maxc - (bstart[i+1] - bstart[i]) + 1]++;
+	for (i = 0; i <= maxc; i++)
+		tmp[i+1] += tmp[i];
+	for (i = 0; i < nb; i++)
+		border[tmp[maxc - (bstart[i+1] - bstart[i])]++] = i;
+
+	memset(taken, 0, ((m+63)/64)*sizeof(u64));
+	memset(disp, 0, nb*sizeof(u32));
+	for (i = 0; i < m; i++)
+		slots[i] = FROZEN_EMPTY;
+	for (k = 0; k < nb; k++) {
+		bk = border[k];
+		c = bstart[bk+1] - bstart[bk];
+		if (c == 0)
+			break;
+		for (d = 0; d < FROZEN_MAX_DISP; d++) {
+			for (j = 0; j < c; j++) {
+				s = frozen_slot(hashes[order[bstart[bk]+j]], d, m);
+				if (taken[s/64] & ((u64)1 << (s%64)))
+					break;
+				taken[s/64] |= (u64)1 << (s%64);
+				tmp[j] = s;
+			}
+			if (j == c)
+				break;
+			while (j-- > 0)
+				taken[tmp[j]/64] &= ~((u64)1 << (tmp[j]%64));
+			if (b->cancel)
+				return 0;
+		}
+		if (d == FROZEN_MAX_DISP)
+			return 0;
+		disp[bk] = d;
+		for (j = 0; j < c; j++)
+			slots[tmp[j]] = offs[order[bstart[bk]+j]];
+	}
+	return 1;
+}
+
+static void*
+frozen_build(void* arg) {
+	struct frozen_build* b = arg;
+	inmemory_kv* kv = b->kv;
+	frozen_header* hdr;
+	hash_item* item;
+	u32 n, nb, m;
+	u64 *hashes, *offs, *taken;
+	u32 *bstart, *order, *border, *tmp;
+	u32 i, ks, vs;
+	kv_pos pos;
+	size_t data_size = 0, head;
+	char* p;
+
+	/* blob keeps 32 bit counts and sizes whatever table is built with */
+	if (kv->tab.size > FROZEN_MAX_COUNT) {
+		b->error = FROZEN_TOO_BIG;
+		return NULL;
+	}
+	n = kv->tab.size;
+	nb = n / FROZEN_BUCKET_KEYS + 1;
+	m = n + n / 20 + 1;
+	head = frozen_head_size(nb, m);
+	for (pos = hash_first(&kv->tab.lru); pos != end; pos = hash_next(&kv->tab, pos)) {
+		item = entry_item(&kv->tab.entries[pos]);
+		if (item_key_size(item) > FROZEN_MAX_LEN || item_val_size(item) > FROZEN_MAX_LEN) {
+			b->error = FROZEN_TOO_BIG;
+			return NULL;
+		}
+		data_size += 8 + (size_t)item_key_size(item) + item_val_size(item);
+	}
+	b->size = head + data_size;
+	b->blob = calloc(1, b->size);
+	hashes = malloc(n*sizeof(u64) + 1);
+	offs = malloc(n*sizeof(u64) + 1);
+	taken = malloc(((m+63)/64)*sizeof(u64));
+	bstart = malloc((nb+1)*sizeof(u32));
+	order = malloc(n*sizeof(u32) + 1);
+	border = malloc(nb*sizeof(u32));
+	tmp = malloc((n+2)*sizeof(u32));
+	if (!b->blob || !hashes || !offs || !taken || !bstart || !order || !border || !tmp) {
+		b->error = FROZEN_NOMEM;
+		goto out;
+	}
+	hdr = (frozen_header*)b->blob;
+	memcpy(hdr->magic, FROZEN_MAGIC, 8);
+	hdr->bom = FROZEN_BOM;
+	hdr->count = n;
+	hdr->nbuckets = nb;
+	hdr->nslots = m;
+	hdr->data_size = data_size;
+	p = b->blob + head;
+	i = 0;
+	for (pos = hash_first(&kv->tab.lru); pos != end; pos = hash_next(&kv->tab, pos)) {
+		item = entry_item(&kv->tab.entries[pos]);
+		ks = item_key_size(item);
+		vs = item_val_size(item);
+		offs[i++] = p - (b->blob + head);
+		memcpy(p, &ks, 4);
+		memcpy(p + 4, &vs, 4);
+		memcpy(p + 8, item_key(item), ks);
+		memcpy(p + 8 + ks, item_val(item), vs);
+		p += 8 + (size_t)ks + vs;
+	}
+	b->error = FROZEN_FAILED;
+	for (i = 0; i < FROZEN_SEEDS && !b->cancel; i++) {
+		hdr->seed = frozen_mix(0x9e3779b97f4a7c15ULL * (i + 1));
+		if (frozen_solve(b, hashes, offs, bstart, order, border, taken, tmp)) {
+			b->error = FROZEN_OK;
+			break;
+		}
+	}
+	if (b->cancel)
+		b->error = FROZEN_CANCEL;
+out:
+	if (b->error != FROZEN_OK) {
+		free(b->blob);
+		b->blob = NULL;
+	}
+	free(hashes);
+	free(offs);
+	free(taken);
+	free(bstart);
+	free(order);
+	free(border);
+	free(tmp);
+	return NULL;
+}
+
+static void
+frozen_build_cancel(void* arg) {
+	struct frozen_build* b = arg;
+	b->cancel = 1;
+}
+
+static VALUE
+frozen_build_body(VALUE arg) {
+	rb_thread_call_without_gvl(frozen_build, (void*)arg, frozen_build_cancel, (void*)arg);
+	return Qnil;
+}
+
+static VALUE
+frozen_build_ensure(VALUE arg) {
+	struct frozen_build* b = (struct frozen_build*)arg;
+	b->kv->busy = 0;
+	return Qnil;
+}
+
+static void
+rb_frozen_free(void* p) {
+	kv_frozen* fz = p;
+	if (fz == NULL)
+		return;
+#ifdef HAVE_MMAP
+	if (fz->mmapped)
+		munmap(fz->blob, fz->size);
+	else
+#endif
+		free(fz->blob);
+	free(fz);
+}
+
+static size_t
+rb_frozen_memsize(const void* p) {
+	const kv_frozen* fz = p;
+	return fz ? sizeof(*fz) + fz->size : 0;
+}
+
+static const rb_data_type_t Frozen_data_type = {
+	"InMemoryKV::Frozen",
+	{NULL, rb_frozen_free, rb_frozen_memsize},
+	0, 0,
+#ifdef RUBY_TYPED_FROZEN_SHAREABLE
+	RUBY_TYPED_FROZEN_SHAREABLE
+#endif
+};
+
+#define GetFrozen(value, pointer) \
+	TypedData_Get_Struct((value), kv_frozen, &Frozen_data_type, (pointer))
+
+static VALUE cls_frozen;
+
+/* takes ownership of blob */
+static VALUE
+frozen_wrap(char* blob, size_t size, int mmapped) {
+	kv_frozen* fz;
+	VALUE obj = TypedData_Make_Struct(cls_frozen, kv_frozen, &Frozen_data_type, fz);
+	frozen_init(fz, blob, size);
+	fz->mmapped = mmapped;
+	return rb_obj_freeze(obj);
+}
+
+static VALUE
+rb_kv_freeze_compact(VALUE self) {
+	inmemory_kv* kv;
+	struct frozen_build b;
+	GetKV(self, kv);
+	memset(&b, 0, sizeof(b));
+	b.kv = kv;
+	kv->busy = 1;
+	rb_ensure(frozen_build_body, (VALUE)&b, frozen_build_ensure, (VALUE)&b);
+	if (b.error == FROZEN_NOMEM) {
+		rb_raise(rb_eNoMemError, "could not malloc");
+	} else if (b.error == FROZEN_CANCEL) {
+		rb_thread_check_ints();
+		rb_raise(rb_eInterrupt, "freeze_compact interrupted");
+	} else if (b.error == FROZEN_FAILED) {
+		rb_raise(rb_eRuntimeError, "could not build perfect hash");
+	} else if (b.error == FROZEN_TOO_BIG) {
+		rb_raise(rb_eRangeError, "table is too large for frozen format");
+	}
+	return frozen_wrap(b.blob, b.size, 0);
+}
+
+static VALUE
+rb_frozen_s_load(VALUE klass, VALUE vpath) {
+	const char* path;
+	char* blob;
+	size_t size;
+	int fd, mmapped = 0;
+	struct stat st;
+
+	FilePathValue(vpath);
+	path = RSTRING_PTR(vpath);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		rb_sys_fail(path);
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		rb_sys_fail(path);
+	}
+	size = st.st_size;
+	if (size < sizeof(frozen_header)) {
+		close(fd);
+		rb_raise(rb_eArgError, "%s is not a frozen table", path);
+	}
+#ifdef HAVE_MMAP
+	blob = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (blob == MAP_FAILED) {
+		close(fd);
+		rb_sys_fail(path);
+	}
+	mmapped = 1;
+#else
+	blob = malloc(size);
+	if (blob == NULL) {
+		close(fd);
+		rb_raise(rb_eNoMemError, "could not malloc");
+	}
+	if (read(fd, blob, size) != (ssize_t)size) {
+		free(blob);
+		close(fd);
+		rb_sys_fail(path);
+	}
+#endif
+	close(fd);
+	if (!frozen_valid(blob, size)) {
+#ifdef HAVE_MMAP
+		munmap(blob, size);
+#else
+		free(blob);
+#endif
+		rb_raise(rb_eArgError, "%s is not a frozen table", path);
+	}
+	return frozen_wrap(blob, size, mmapped);
+}
+
+static VALUE
+rb_frozen_dump(VALUE self) {
+	kv_frozen* fz;
+	GetFrozen(self, fz);
+	return rb_str_new(fz->blob, fz->size);
+}
+
+static VALUE
+rb_frozen_get(VALUE self, VALUE vkey) {
+	kv_frozen* fz;
+	const char* val;
+	u32 val_size;
+	GetFrozen(self, fz);
+	StringValue(vkey);
+	val = frozen_get(fz, RSTRING_PTR(vkey), RSTRING_LEN(vkey), &val_size);
+	if (val == NULL) return Qnil;
+	return rb_str_new(val, val_size);
+}
+
+static VALUE
+rb_frozen_include(VALUE self, VALUE vkey) {
+	kv_frozen* fz;
+	u32 val_size;
+	GetFrozen(self, fz);
+	StringValue(vkey);
+	return frozen_get(fz, RSTRING_PTR(vkey), RSTRING_LEN(vkey), &val_size) ? Qtrue : Qfalse;
+}
+
+static VALUE
+rb_frozen_size(VALUE self) {
+	kv_frozen* fz;
+	GetFrozen(self, fz);
+	return UINT2NUM(fz->hdr->count);
+}
+
+static VALUE
+rb_frozen_empty_p(VALUE self) {
+	kv_frozen* fz;
+	GetFrozen(self, fz);
+	return fz->hdr->count ? Qfalse : Qtrue;
+}
+
+static VALUE
+rb_frozen_bytesize(VALUE self) {
+	kv_frozen* fz;
+	GetFrozen(self, fz);
+	return SIZET2NUM(fz->size);
+}
+
+static void
+frozen_keys_i(const char* key, u32 key_size, const char* val, u32 val_size, void* arg) {
+	rb_ary_push((VALUE)arg, rb_str_new(key, key_size));
+}
+
+static void
+frozen_vals_i(const char* key, u32 key_size, const char* val, u32 val_size, void* arg) {
+	rb_ary_push((VALUE)arg, rb_str_new(val, val_size));
+}
+
+static void
+frozen_pairs_i(const char* key, u32 key_size, const char* val, u32 val_size, void* arg) {
+	rb_ary_push((VALUE)arg, rb_assoc_new(rb_str_new(key, key_size), rb_str_new(val, val_size)));
+}
+
+static void
+frozen_key_i(const char* key, u32 key_size, const char* val, u32 val_size, void* arg) {
+	rb_yield(rb_str_new(key, key_size));
+}
+
+static void
+frozen_val_i(const char* key, u32 key_size, const char* val, u32 val_size, void* arg) {
+	rb_yield(rb_str_new(val, val_size));
+}
+
+static void
+frozen_pair_i(const char* key, u32 key_size, const char* val, u32 val_size, void* arg) {
+	rb_yield_values(2, rb_str_new(key, key_size), rb_str_new(val, val_size));
+}
+
+static VALUE
+frozen_collect(VALUE self, frozen_each_cb cb) {
+	kv_frozen* fz;
+	VALUE res;
+	GetFrozen(self, fz);
+	res = rb_ary_new2(fz->hdr->count);
+	frozen_each(fz, cb, (void*)res);
+	return res;
+}
+
+static VALUE
+rb_frozen_keys(VALUE self) {
+	return frozen_collect(self, frozen_keys_i);
+}
+
+static VALUE
+rb_frozen_vals(VALUE self) {
+	return frozen_collect(self, frozen_vals_i);
+}
+
+static VALUE
+rb_frozen_entries(VALUE self) {
+	return frozen_collect(self, frozen_pairs_i);
+}
+
+static VALUE
+rb_frozen_each_key(VALUE self) {
+	kv_frozen* fz;
+	RETURN_ENUMERATOR(self, 0, 0);
+	GetFrozen(self, fz);
+	frozen_each(fz, frozen_key_i, NULL);
+	return self;
+}
+
+static VALUE
+rb_frozen_each_val(VALUE self) {
+	kv_frozen* fz;
+	RETURN_ENUMERATOR(self, 0, 0);
+	GetFrozen(self, fz);
+	frozen_each(fz, frozen_val_i, NULL);
+	return self;
+}
+
+static VALUE
+rb_frozen_each(VALUE self) {
+	kv_frozen* fz;
+	RETURN_ENUMERATOR(self, 0, 0);
+	GetFrozen(self, fz);
+	frozen_each(fz, frozen_pair_i, NULL);
+	return self;
+}
+
+static const rb_data_type_t Namespaced_data_type = {
+	"InMemoryKV::Namespaced",
+	{NULL, rb_kv_destroy, rb_kv_memsize}
+};
+#define GetNKV(value, pointer) do { \
+	TypedData_Get_Struct((value), inmemory_kv, &Namespaced_data_type, (pointer)); \
+	kv_check_busy(pointer); \
+} while (0)
+
+static VALUE
+rb_nkv_alloc(VALUE klass) {
+	inmemory_kv* kv = calloc(1, sizeof(inmemory_kv));
+	kv->ns_alloced = 16;
+	kv->ns = calloc(kv->ns_alloced, sizeof(kv_ns));
+	return TypedData_Wrap_Struct(klass, &Namespaced_data_type, kv);
+}
+
+static u32
+nkv_ns_id(VALUE vns) {
+	long id = NUM2LONG(vns);
+	if (id < 0)
+		rb_raise(rb_eArgError, "namespace id %ld is negative", id);
+	if (id >= NS_MAX)
+		rb_raise(rb_eArgError, "namespace id %ld is too large", id);
+	return id;
+}
+
+/* returns NULL for namespace never used */
+static kv_ns*
+nkv_ns(inmemory_kv* kv, VALUE vns) {
+	u32 id = nkv_ns_id(vns);
+	return id < kv->ns_alloced ? &kv->ns[id] : NULL;
+}
+
+static kv_ns*
+nkv_ns_reserve(inmemory_kv* kv, VALUE vns) {
+	u32 id = nkv_ns_id(vns);
+	if (id >= kv->ns_alloced) {
+		u32 new_alloced = kv->ns_alloced * 2;
+		kv_ns* new_ns;
+		if (new_alloced <= id) new_alloced = id + 1;
+		new_ns = realloc(kv->ns, new_alloced * sizeof(kv_ns));
+		if (new_ns == NULL)
+			rb_raise(rb_eNoMemError, "could not malloc");
+		memset(new_ns + kv->ns_alloced, 0,
+				(new_alloced - kv->ns_alloced) * sizeof(kv_ns));
+		kv->ns = new_ns;
+		kv->ns_alloced = new_alloced;
+	}
+	return &kv->ns[id];
+}
+
+/* key prefixed with namespace id */
+typedef struct nkv_key {
+	char* ptr;
+	kv_len size;
+	VALUE tmp;
+	char buf[256];
+} nkv_key;
+
+static void
+nkv_key_init(nkv_key* nk, VALUE vns, VALUE vkey) {
+	u32 id = nkv_ns_id(vns);
+	KeyValue(vkey);
+	nk->size = RSTRING_LEN(vkey) + NS_PREFIX;
+	nk->tmp = 0;
+	if (nk->size <= sizeof(nk->buf)) {
+		nk->ptr = nk->buf;
+	} else {
+		nk->ptr = ALLOCV(nk->tmp, nk->size);
+	}
+	memcpy(nk->ptr, &id, NS_PREFIX);
+	memcpy(nk->ptr + NS_PREFIX, RSTRING_PTR(vkey), RSTRING_LEN(vkey));
+}
+
+static void
+nkv_key_free(nkv_key* nk) {
+	if (nk->tmp) ALLOCV_END(nk->tmp);
+}
+
+static hash_item*
+nkv_fetch(inmemory_kv* kv, VALUE vns, VALUE vkey) {
+	nkv_key nk;
+	hash_item* item;
+	if (nkv_ns(kv, vns) == NULL) return NULL;
+	nkv_key_init(&nk, vns, vkey);
+	item = kv_fetch(kv, nk.ptr, nk.size);
+	nkv_key_free(&nk);
+	return item;
+}
+
+/* evicts oldest entries of namespace, but keeps last one */
+static void
+nkv_evict(inmemory_kv* kv, kv_ns* ns) {
+	while (ns->quota && ns->data_size > ns->quota && ns->size > 1) {
+		kv_delete(kv, kv_first_in(kv, &ns->lru));
+	}
+}
+
+static inline VALUE
+nitem_key_str(hash_item* item) {
+	return rb_str_new(item_key(item) + NS_PREFIX, item_key_size(item) - NS_PREFIX);
+}
+
+static VALUE
+rb_nkv_get(VALUE self, VALUE vns, VALUE vkey) {
+	inmemory_kv* kv;
+	hash_item* item;
+	GetNKV(self, kv);
+	item = nkv_fetch(kv, vns, vkey);
+	if (item == NULL) return Qnil;
+	return item_val_str(item);
+}
+
+static VALUE
+rb_nkv_include(VALUE self, VALUE vns, VALUE vkey) {
+	inmemory_kv* kv;
+	GetNKV(self, kv);
+	return nkv_fetch(kv, vns, vkey) ? Qtrue : Qfalse;
+}
+
+static VALUE
+rb_nkv_up(VALUE self, VALUE vns, VALUE vkey) {
+	inmemory_kv* kv;
+	hash_item* item;
+	GetNKV(self, kv);
+	item = nkv_fetch(kv, vns, vkey);
+	if (item == NULL) return Qnil;
+	kv_up(kv, item);
+	return item_val_str(item);
+}
+
+static VALUE
+rb_nkv_down(VALUE self, VALUE vns, VALUE vkey) {
+	inmemory_kv* kv;
+	hash_item* item;
+	GetNKV(self, kv);
+	item = nkv_fetch(kv, vns, vkey);
+	if (item == NULL) return Qnil;
+	kv_down(kv, item);
+	return item_val_str(item);
+}
+
+static VALUE
+rb_nkv_set(VALUE self, VALUE vns, VALUE vkey, VALUE vval) {
+	inmemory_kv* kv;
+	kv_ns* ns;
+	nkv_key nk;
+	hash_item* item;
+
+	GetNKV(self, kv);
+	ValValue(vval);
+	ns = nkv_ns_reserve(kv, vns);
+	nkv_key_init(&nk, vns, vkey);
+	item = kv_insert(kv, nk.ptr, nk.size, RSTRING_PTR(vval), RSTRING_LEN(vval));
+	nkv_key_free(&nk);
+	if (item == NULL) {
+		rb_raise(rb_eNoMemError, "could not malloc");
+	}
+	nkv_evict(kv, ns);
+	return vval;
+}
+
+static VALUE
+rb_nkv_del(VALUE self, VALUE vns, VALUE vkey) {
+	inmemory_kv* kv;
+	nkv_key nk;
+	hash_item* item;
+	kv_slot slot;
+	VALUE res;
+	GetNKV(self, kv);
+	if (nkv_ns(kv, vns) == NULL) return Qnil;
+	nkv_key_init(&nk, vns, vkey);
+	item = kv_lookup(kv, nk.ptr, nk.size, &slot);
+	nkv_key_free(&nk);
+	if (item == NULL) return Qnil;
+	res = item_val_str(item);
+	kv_delete_at(kv, &slot, item);
+	return res;
+}
+
+static VALUE
+rb_nkv_first(VALUE self, VALUE vns) {
+	inmemory_kv* kv;
+	kv_ns* ns;
+	hash_item* item;
+	GetNKV(self, kv);
+	ns = nkv_ns(kv, vns);
+	if (ns == NULL) return Qnil;
+	item = kv_first_in(kv, &ns->lru);
+	if (item == NULL) return Qnil;
+	return rb_assoc_new(nitem_key_str(item), item_val_str(item));
+}
+
+static VALUE
+rb_nkv_shift(VALUE self, VALUE vns) {
+	inmemory_kv* kv;
+	kv_ns* ns;
+	hash_item* item;
+	VALUE res;
+	GetNKV(self, kv);
+	ns = nkv_ns(kv, vns);
+	if (ns == NULL) return Qnil;
+	item = kv_first_in(kv, &ns->lru);
+	if (item == NULL) return Qnil;
+	res = rb_assoc_new(nitem_key_str(item), item_val_str(item));
+	kv_delete(kv, item);
+	return res;
+}
+
+static VALUE
+rb_nkv_size(int argc, VALUE *argv, VALUE self) {
+	inmemory_kv* kv;
+	kv_ns* ns;
+	VALUE vns;
+	GetNKV(self, kv);
+	rb_scan_args(argc, argv, "01", &vns);
+	if (NIL_P(vns)) return POS2NUM(kv->tab.size);
+	ns = nkv_ns(kv, vns);
+	return POS2NUM(ns ? ns->size : 0);
+}
+
+static VALUE
+rb_nkv_data_size(int argc, VALUE *argv, VALUE self) {
+	inmemory_kv* kv;
+	kv_ns* ns;
+	VALUE vns;
+	GetNKV(self, kv);
+	rb_scan_args(argc, argv, "01", &vns);
+	if (NIL_P(vns)) return SIZET2NUM(kv->total_size);
+	ns = nkv_ns(kv, vns);
+	return SIZET2NUM(ns ? ns->data_size : 0);
+}
+
+static VALUE
+rb_nkv_total_size(VALUE self) {
+	inmemory_kv* kv;
+	GetNKV(self, kv);
+	return SIZET2NUM(rb_kv_memsize(kv));
+}
+
+static VALUE
+rb_nkv_quota(VALUE self, VALUE vns) {
+	inmemory_kv* kv;
+	kv_ns* ns;
+	GetNKV(self, kv);
+	ns = nkv_ns(kv, vns);
+	return ns && ns->quota ? SIZET2NUM(ns->quota) : Qnil;
+}
+
+static VALUE
+rb_nkv_set_quota(VALUE self, VALUE vns, VALUE vquota) {
+	inmemory_kv* kv;
+	kv_ns* ns;
+	GetNKV(self, kv);
+	ns = nkv_ns_reserve(kv, vns);
+	ns->quota = NIL_P(vquota) ? 0 : NUM2SIZET(vquota);
+	nkv_evict(kv, ns);
+	return vquota;
+}
+
+static VALUE
+rb_nkv_clear(int argc, VALUE *argv, VALUE self) {
+	inmemory_kv* kv;
+	kv_ns* ns;
+	hash_item* item;
+	VALUE vns, opts;
+	GetNKV(self, kv);
+	rb_scan_args(argc, argv, "01:", &vns, &opts);
+	if (NIL_P(vns)) {
+		kv_clear(kv, opt_async(opts));
+		return self;
+	}
+	ns = nkv_ns(kv, vns);
+	if (ns == NULL) return self;
+	while ((item = kv_first_in(kv, &ns->lru)) != NULL) {
+		kv_delete(kv, item);
+	}
+	return self;
+}
+
+static VALUE
+rb_nkv_namespaces(VALUE self) {
+	inmemory_kv* kv;
+	VALUE res;
+	u32 i;
+	GetNKV(self, kv);
+	res = rb_ary_new();
+	for (i = 0; i < kv->ns_alloced; i++) {
+		if (kv->ns[i].size) rb_ary_push(res, UINT2NUM(i));
+	}
+	return res;
+}
+
+static void
+nkeys_i(hash_item* item, void* arg) {
+	rb_ary_push((VALUE)arg, nitem_key_str(item));
+}
+
+static void
+npairs_i(hash_item* item, void* arg) {
+	rb_ary_push((VALUE)arg, rb_assoc_new(nitem_key_str(item), item_val_str(item)));
+}
+
+static void
+nkey_i(hash_item* item, void* _ __attribute__((unused))) {
+	rb_yield(nitem_key_str(item));
+}
+
+static void
+npair_i(hash_item* item, void* _ __attribute__((unused))) {
+	rb_yield(rb_assoc_new(nitem_key_str(item), item_val_str(item)));
+}
+
+static VALUE
+nkv_collect(VALUE self, VALUE vns, kv_each_cb cb) {
+	inmemory_kv* kv;
+	kv_ns* ns;
+	VALUE res;
+	GetNKV(self, kv);
+	ns = nkv_ns(kv, vns);
+	if (ns == NULL) return rb_ary_new();
+	res = rb_ary_new2(ns->size);
+	kv_each_in(kv, &ns->lru, cb, (void*)res);
+	return res;
+}
+
+static VALUE
+rb_nkv_keys(VALUE self, VALUE vns) {
+	return nkv_collect(self, vns, nkeys_i);
+}
+
+static VALUE
+rb_nkv_vals(VALUE self, VALUE vns) {
+	return nkv_collect(self, vns, vals_i);
+}
+
+static VALUE
+rb_nkv_entries(VALUE self, VALUE vns) {
+	return nkv_collect(self, vns, npairs_i);
+}
+
+static VALUE
+nkv_iterate(VALUE self, VALUE vns, kv_each_cb cb) {
+	inmemory_kv* kv;
+	kv_ns* ns;
+	GetNKV(self, kv);
+	ns = nkv_ns(kv, vns);
+	if (ns != NULL)
+		kv_each_in(kv, &ns->lru, cb, NULL);
+	return self;
+}
+
+static VALUE
+rb_nkv_each_key(VALUE self, VALUE vns) {
+	RETURN_ENUMERATOR(self, 1, &vns);
+	return nkv_iterate(self, vns, nkey_i);
+}
+
+static VALUE
+rb_nkv_each_val(VALUE self, VALUE vns) {
+	RETURN_ENUMERATOR(self, 1, &vns);
+	return nkv_iterate(self, vns, val_i);
+}
+
+static VALUE
+rb_nkv_each(VALUE self, VALUE vns) {
+	RETURN_ENUMERATOR(self, 1, &vns);
+	return nkv_iterate(self, vns, npair_i);
+}
+
+static VALUE
+rb_nkv_init_copy(VALUE self, VALUE orig) {
+	inmemory_kv *origin, *new;
+	GetNKV(self, new);
+	GetNKV(orig, origin);
+	if (!kv_copy_to(origin, new)) {
+		rb_raise(rb_eNoMemError, "could not malloc");
+	}
+	return self;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/* Memcached text and meta protocol frontend.
+ * epoll_wait runs without GVL, but commands are executed under GVL, cause
+ * table is not thread-safe. Values are sent with writev straight from items,
+ * so pending iovecs are flushed before any mutating command. */
+
+#define CONN_IOV 64
+#define CONN_SCRATCH 8192
+#define CONN_LINE_MAX 8192
+#define CONN_READ_MAX (4 << 20)
+#define CONN_WBUF_MAX (1 << 20)
+#define CONN_TOKENS 24
+#define SERVER_EVENTS 64
+#define KEY_MAX 250
+#define META_OPAQUE_MAX 32
+
+typedef struct kv_conn {
+	struct kv_conn *next, *prev;
+	int fd;
+	u32 events;
+	u32 closing : 1;
+	u32 eof : 1;
+	char* rbuf;
+	size_t rlen, ralloced;
+	size_t skip; /* rest of too large data block, discarded as it arrives */
+	char* wbuf;
+	size_t wpos, wlen, walloced;
+	int niov;
+	size_t slen;
+	struct iovec iov[CONN_IOV];
+	char scratch[CONN_SCRATCH];
+} kv_conn;
+
+typedef struct kv_server {
+	VALUE table;
+	VALUE listener;
+	int lfd;
+	int epfd;
+	int wake[2];
+	int stop;
+	int running;
+	int deferred; /* table was busy, so some input is not processed */
+	kv_conn conns;
+} kv_server;
+
+typedef struct token {
+	const char* s;
+	size_t len;
+} token;
+
+static size_t
+conn_pending(kv_conn* conn) {
+	return conn->wlen - conn->wpos;
+}
+
+static int
+conn_wbuf_append(kv_conn* conn, const char* p, size_t len) {
+	if (conn->wpos == conn->wlen) {
+		conn->wpos = conn->wlen = 0;
+	}
+	if (conn->wlen + len > conn->walloced) {
+		size_t new_alloced = conn->walloced ? conn->walloced : 4096;
+		char* new_wbuf;
+		while (new_alloced < conn->wlen + len)
+			new_alloced *= 2;
+		new_wbuf = realloc(conn->wbuf, new_alloced);
+		if (new_wbuf == NULL)
+			return 0;
+		conn->wbuf = new_wbuf;
+		conn->walloced = new_alloced;
+	}
+	memcpy(conn->wbuf + conn->wlen, p, len);
+	conn->wlen += len;
+	return 1;
+}
+
+static void
+conn_flush(kv_conn* conn) {
+	ssize_t n = 0;
+	int i;
+	if (conn->niov == 0 || conn->closing)
+		goto done;
+	if (conn_pending(conn) == 0) {
+		do {
+			n = writev(conn->fd, conn->iov, conn->niov);
+		} while (n < 0 && errno == EINTR);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				conn->closing = 1;
+				goto done;
+			}
+			n = 0;
+		}
+	}
+	for (i = 0; i < conn->niov; i++) {
+		size_t len = conn->iov[i].iov_len;
+		if ((size_t)n >= len) {
+			n -= len;
+			continue;
+		}
+		if (!conn_wbuf_append(conn, (char*)conn->iov[i].iov_base + n, len - n)) {
+			conn->closing = 1;
+			break;
+		}
+		n = 0;
+	}
+done:
+	conn->niov = 0;
+	conn->slen = 0;
+}
+
+static void
+conn_write_pending(kv_conn* conn) {
+	ssize_t n;
+	while (conn_pending(conn) > 0) {
+		n = write(conn->fd, conn->wbuf + conn->wpos, conn_pending(conn));
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				conn->closing = 1;
+			return;
+		}
+		conn->wpos += n;
+	}
+	conn->wpos = conn->wlen = 0;
+	if (conn->walloced > CONN_WBUF_MAX) {
+		free(conn->wbuf);
+		conn->wbuf = NULL;
+		conn->walloced = 0;
+	}
+}
+
+/* zero-copy: p should stay valid until conn_flush */
+static void
+conn_out(kv_conn* conn, const char* p, size_t len) {
+	if (len == 0) return;
+	if (conn->niov == CONN_IOV)
+		conn_flush(conn);
+	conn->iov[conn->niov].iov_base = (char*)p;
+	conn->iov[conn->niov].iov_len = len;
+	conn->niov++;
+}
+
+#define conn_outs(conn, s) conn_out((conn), (s), sizeof(s)-1)
+
+static void
+conn_copy(kv_conn* conn, const char* p, size_t len) {
+	struct iovec* last;
+	if (len > CONN_SCRATCH) {
+		/* queued after pending output, so order is kept */
+		conn_flush(conn);
+		if (!conn_wbuf_append(conn, p, len))
+			conn->closing = 1;
+		return;
+	}
+	/* conn_out below would flush full iov and reset slen under us */
+	if (conn->slen + len > CONN_SCRATCH || conn->niov == CONN_IOV)
+		conn_flush(conn);
+	memcpy(conn->scratch + conn->slen, p, len);
+	last = conn->niov ? &conn->iov[conn->niov-1] : NULL;
+	if (last && (char*)last->iov_base + last->iov_len == conn->scratch + conn->slen) {
+		last->iov_len += len;
+	} else {
+		conn_out(conn, conn->scratch + conn->slen, len);
+	}
+	conn->slen += len;
+}
+
+static void
+conn_copy_u64(kv_conn* conn, u64 v) {
+	char buf[24];
+	int n = snprintf(buf, sizeof(buf), "%llu", v);
+	conn_copy(conn, buf, n);
+}
+
+static const char*
+line_end(const char* line, size_t len) {
+	while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+		len--;
+	return line + len;
+}
+
+/* stores next token of [*p, end) to tok and advances *p, 0 at line end */
+static int
+tok_next(const char** p, const char* end, token* tok) {
+	const char* s = *p;
+	while (s < end && *s == ' ') s++;
+	if (s == end) return 0;
+	tok->s = s;
+	while (s < end && *s != ' ') s++;
+	tok->len = s - tok->s;
+	*p = s;
+	return 1;
+}
+
+/* stores up to max tokens, but returns count of all tokens of line */
+static int
+tokenize(const char* line, size_t len, token* tok, int max) {
+	const char *p = line, *end = line_end(line, len);
+	token t;
+	int n = 0;
+	while (tok_next(&p, end, &t)) {
+		if (n < max) tok[n] = t;
+		n++;
+	}
+	return n;
+}
+
+static inline int
+tok_is(token* tok, const char* s) {
+	size_t len = strlen(s);
+	return tok->len == len && memcmp(tok->s, s, len) == 0;
+}
+
+static int
+tok_u64(const char* s, size_t len, u64* v) {
+	u64 r = 0;
+	size_t i;
+	if (len == 0 || len > 20) return 0;
+	for (i = 0; i < len; i++) {
+		if (s[i] < '0' || s[i] > '9') return 0;
+		if (r > ((u64)0 - 1 - (s[i] - '0')) / 10) return 0;
+		r = r * 10 + (s[i] - '0');
+	}
+	*v = r;
+	return 1;
+}
+
+enum { ARITH_OK, ARITH_MISS, ARITH_NAN, ARITH_NOMEM };
+
+static int
+server_arith(inmemory_kv* kv, token* key, int incr, u64 delta, u64* res) {
+	hash_item* item;
+	kv_slot slot;
+	char buf[24];
+	u64 v;
+	int n;
+	item = kv_lookup(kv, key->s, key->len, &slot);
+	if (item == NULL)
+		return ARITH_MISS;
+	if (!tok_u64(item_val(item), item_val_size(item), &v))
+		return ARITH_NAN;
+	if (incr)
+		v += delta;
+	else
+		v = v > delta ? v - delta : 0;
+	n = snprintf(buf, sizeof(buf), "%llu", v);
+	if (kv_write(kv, &slot, item, key->s, key->len, buf, n) == NULL)
+		return ARITH_NOMEM;
+	*res = v;
+	return ARITH_OK;
+}
+
+enum { STORE_SET, STORE_ADD, STORE_REPLACE, STORE_APPEND, STORE_PREPEND };
+enum { STORED, NOT_STORED, STORE_NOMEM };
+
+static int
+server_store(inmemory_kv* kv, int mode, token* key, const char* data, size_t size) {
+	hash_item* item;
+	kv_slot slot;
+	item = kv_lookup(kv, key->s, key->len, &slot);
+	if (mode != STORE_SET && (item != NULL) == (mode == STORE_ADD))
+		return NOT_STORED;
+	if (mode != STORE_APPEND && mode != STORE_PREPEND) {
+		item = kv_write(kv, &slot, item, key->s, key->len, data, size);
+		return item ? STORED : STORE_NOMEM;
+	}
+	switch (kv_edit(kv, &slot, item, key->s, key->len,
+				mode == STORE_APPEND ? EDIT_APPEND : EDIT_PREPEND,
+				0, data, size, &item)) {
+	case EDIT_OK: return STORED;
+	case EDIT_TOO_BIG: return NOT_STORED;
+	default: return STORE_NOMEM;
+	}
+}
+
+static void
+conn_store_reply(kv_conn* conn, int res) {
+	switch (res) {
+	case STORED: conn_outs(conn, "STORED\r\n"); break;
+	case NOT_STORED: conn_outs(conn, "NOT_STORED\r\n"); break;
+	default: conn_outs(conn, "SERVER_ERROR out of memory storing object\r\n");
+	}
+}
+
+/* Data block has to fit read buffer together with command line, else it
+ * is refused and discarded, so connection stays usable. */
+static int
+conn_too_large(kv_conn* conn, size_t line_len, u64 size) {
+	if (line_len + size + 2 <= CONN_READ_MAX)
+		return 0;
+	conn_outs(conn, "SERVER_ERROR object too large for cache\r\n");
+	conn->skip = size + 2;
+	return 1;
+}
+
+/* returns consumed bytes, 0 if value block is not fully read yet */
+static size_t
+conn_text_command(inmemory_kv* kv, kv_conn* conn, token* tok, int ntok, const char* line, size_t line_len, size_t avail) {
+	int noreply = ntok > 1 && tok_is(&tok[ntok-1], "noreply");
+	hash_item* item;
+	kv_slot slot;
+
+	if (tok_is(&tok[0], "get") || tok_is(&tok[0], "gets")) {
+		/* keys are walked over whole line, it may have more than CONN_TOKENS */
+		int gets = tok[0].len == 4;
+		const char *p, *end = line_end(line, line_len);
+		token key;
+		for (p = tok[0].s + tok[0].len; tok_next(&p, end, &key); ) {
+			if (key.len > KEY_MAX) {
+				conn_outs(conn, "CLIENT_ERROR bad command line format\r\n");
+				return line_len;
+			}
+		}
+		for (p = tok[0].s + tok[0].len; tok_next(&p, end, &key); ) {
+			item = kv_fetch(kv, key.s, key.len);
+			if (item == NULL) continue;
+			conn_copy(conn, "VALUE ", 6);
+			conn_copy(conn, key.s, key.len);
+			conn_copy(conn, " 0 ", 3);
+			conn_copy_u64(conn, item_val_size(item));
+			if (gets) conn_copy(conn, " 0", 2);
+			conn_copy(conn, "\r\n", 2);
+			conn_out(conn, item_val(item), item_val_size(item));
+			conn_outs(conn, "\r\n");
+		}
+		conn_outs(conn, "END\r\n");
+		return line_len;
+	}
+	if (tok_is(&tok[0], "set") || tok_is(&tok[0], "add") ||
+			tok_is(&tok[0], "replace") || tok_is(&tok[0], "append") ||
+			tok_is(&tok[0], "prepend")) {
+		static const char* modes[] = {"set", "add", "replace", "append", "prepend"};
+		u64 size;
+		const char* data;
+		int mode = 0, res;
+		if ((ntok != 5 && ntok != 6) || tok[1].len > KEY_MAX ||
+				!tok_u64(tok[4].s, tok[4].len, &size) || size > KV_LEN_MAX) {
+			conn_outs(conn, "CLIENT_ERROR bad command line format\r\n");
+			conn->closing = 1;
+			return line_len;
+		}
+		if (conn_too_large(conn, line_len, size))
+			return line_len;
+		if (avail < line_len + size + 2)
+			return 0;
+		data = line + line_len;
+		if (data[size] != '\r' || data[size+1] != '\n') {
+			conn_outs(conn, "CLIENT_ERROR bad data chunk\r\n");
+			conn->closing = 1;
+			return line_len;
+		}
+		while (!tok_is(&tok[0], modes[mode])) mode++;
+		conn_flush(conn);
+		res = server_store(kv, mode, &tok[1], data, size);
+		if (!noreply || res == STORE_NOMEM)
+			conn_store_reply(conn, res);
+		return line_len + size + 2;
+	}
+	if (tok_is(&tok[0], "delete")) {
+		if (ntok < 2 || tok[1].len > KEY_MAX) {
+			conn_outs(conn, "CLIENT_ERROR bad command line format\r\n");
+			return line_len;
+		}
+		conn_flush(conn);
+		item = kv_lookup(kv, tok[1].s, tok[1].len, &slot);
+		if (item != NULL)
+			kv_delete_at(kv, &slot, item);
+		if (!noreply) {
+			if (item != NULL)
+				conn_outs(conn, "DELETED\r\n");
+			else
+				conn_outs(conn, "NOT_FOUND\r\n");
+		}
+		return line_len;
+	}
+	if (tok_is(&tok[0], "incr") || tok_is(&tok[0], "decr")) {
+		u64 delta, res = 0;
+		int r;
+		if (ntok < 3 || tok[1].len > KEY_MAX) {
+			conn_outs(conn, "CLIENT_ERROR bad command line format\r\n");
+			return line_len;
+		}
+		if (!tok_u64(tok[2].s, tok[2].len, &delta)) {
+			conn_outs(conn, "CLIENT_ERROR invalid numeric delta argument\r\n");
+			return line_len;
+		}
+		conn_flush(conn);
+		r = server_arith(kv, &tok[1], tok[0].s[0] == 'i', delta, &res);
+		if (r == ARITH_NAN) {
+			conn_outs(conn, "CLIENT_ERROR cannot increment or decrement non-numeric value\r\n");
+		} else if (r == ARITH_NOMEM) {
+			conn_outs(conn, "SERVER_ERROR out of memory\r\n");
+		} else if (!noreply) {
+			if (r == ARITH_MISS) {
+				conn_outs(conn, "NOT_FOUND\r\n");
+			} else {
+				conn_copy_u64(conn, res);
+				conn_copy(conn, "\r\n", 2);
+			}
+		}
+		return line_len;
+	}
+	if (tok_is(&tok[0], "flush_all")) {
+		conn_flush(conn);
+		kv_clear(kv, 1);
+		if (!noreply) conn_outs(conn, "OK\r\n");
+		return line_len;
+	}
+	if (tok_is(&tok[0], "version")) {
+		conn_outs(conn, "VERSION inmemory_kv\r\n");
+		return line_len;
+	}
+	if (tok_is(&tok[0], "quit")) {
+		conn->eof = 1;
+		return line_len;
+	}
+	conn_outs(conn, "ERROR\r\n");
+	return line_len;
+}
+
+/* echoes k, O and f flags, s and t only on hit */
+static void
+conn_meta_flags(kv_conn* conn, token* tok, int ntok, token* key, hash_item* item) {
+	int i;
+	for (i = 0; i < ntok; i++) {
+		switch (tok[i].s[0]) {
+		case 'k':
+			conn_copy(conn, " k", 2);
+			conn_copy(conn, key->s, key->len);
+			break;
+		case 'O':
+			conn_copy(conn, " ", 1);
+			conn_copy(conn, tok[i].s, tok[i].len);
+			break;
+		case 'f':
+			conn_copy(conn, " f0", 3);
+			break;
+		case 's':
+			if (item == NULL) break;
+			conn_copy(conn, " s", 2);
+			conn_copy_u64(conn, item_val_size(item));
+			break;
+		case 't':
+			if (item == NULL) break;
+			conn_copy(conn, " t-1", 4);
+			break;
+		}
+	}
+}
+
+/* opaque is echoed back, so it is limited like in memcached */
+static int
+meta_opaque_too_long(token* tok, int ntok) {
+	int i;
+	for (i = 0; i < ntok; i++) {
+		if (tok[i].s[0] == 'O' && tok[i].len > 1 + META_OPAQUE_MAX) return 1;
+	}
+	return 0;
+}
+
+static int
+meta_has(token* tok, int ntok, char flag) {
+	int i;
+	for (i = 0; i < ntok; i++) {
+		if (tok[i].s[0] == flag) return i + 1;
+	}
+	return 0;
+}
+
+static size_t
+conn_meta_command(inmemory_kv* kv, kv_conn* conn, token* tok, int ntok, const char* line, size_t line_len, size_t avail) {
+	token* key = &tok[1];
+	hash_item* item;
+	kv_slot slot;
+	int quiet;
+
+	if (tok_is(&tok[0], "mn")) {
+		conn_outs(conn, "MN\r\n");
+		return line_len;
+	}
+	if (ntok < 2 || key->len > KEY_MAX) {
+		conn_outs(conn, "CLIENT_ERROR bad command line format\r\n");
+		return line_len;
+	}
+	if (meta_opaque_too_long(tok + 2, ntok - 2)) {
+		u64 size;
+		conn_outs(conn, "CLIENT_ERROR opaque token too long\r\n");
+		/* data block of ms is dropped as it arrives */
+		if (tok_is(&tok[0], "ms") && ntok > 2 &&
+				tok_u64(tok[2].s, tok[2].len, &size) && size <= KV_LEN_MAX)
+			conn->skip = size + 2;
+		return line_len;
+	}
+	if (tok_is(&tok[0], "mg")) {
+		tok += 2; ntok -= 2;
+		quiet = meta_has(tok, ntok, 'q');
+		item = kv_fetch(kv, key->s, key->len);
+		if (item == NULL) {
+			if (!quiet) conn_outs(conn, "EN\r\n");
+			return line_len;
+		}
+		if (meta_has(tok, ntok, 'v')) {
+			conn_copy(conn, "VA ", 3);
+			conn_copy_u64(conn, item_val_size(item));
+			conn_meta_flags(conn, tok, ntok, key, item);
+			conn_copy(conn, "\r\n", 2);
+			conn_out(conn, item_val(item), item_val_size(item));
+			conn_outs(conn, "\r\n");
+		} else {
+			conn_copy(conn, "HD", 2);
+			conn_meta_flags(conn, tok, ntok, key, item);
+			conn_copy(conn, "\r\n", 2);
+		}
+		return line_len;
+	}
+	if (tok_is(&tok[0], "ms")) {
+		u64 size;
+		const char* data;
+		int mode = STORE_SET, res, m;
+		if (ntok < 3 || !tok_u64(tok[2].s, tok[2].len, &size) || size > KV_LEN_MAX) {
+			conn_outs(conn, "CLIENT_ERROR bad command line format\r\n");
+			conn->closing = 1;
+			return line_len;
+		}
+		if (conn_too_large(conn, line_len, size))
+			return line_len;
+		if (avail < line_len + size + 2)
+			return 0;
+		data = line + line_len;
+		if (data[size] != '\r' || data[size+1] != '\n') {
+			conn_outs(conn, "CLIENT_ERROR bad data chunk\r\n");
+			conn->closing = 1;
+			return line_len;
+		}
+		tok += 3; ntok -= 3;
+		quiet = meta_has(tok, ntok, 'q');
+		if ((m = meta_has(tok, ntok, 'M')) != 0 && tok[m-1].len > 1) {
+			switch (tok[m-1].s[1]) {
+			case 'E': case 'e': mode = STORE_ADD; break;
+			case 'R': case 'r': mode = STORE_REPLACE; break;
+			case 'A': case 'a': mode = STORE_APPEND; break;
+			case 'P': case 'p': mode = STORE_PREPEND; break;
+			}
+		}
+		conn_flush(conn);
+		res = server_store(kv, mode, key, data, size);
+		if (res == STORED) {
+			if (!quiet) {
+				conn_copy(conn, "HD", 2);
+				conn_meta_flags(conn, tok, ntok, key, NULL);
+				conn_copy(conn, "\r\n", 2);
+			}
+		} else if (res == NOT_STORED) {
+			conn_outs(conn, "NS\r\n");
+		} else {
+			conn_outs(conn, "SERVER_ERROR out of memory storing object\r\n");
+		}
+		return line_len + size + 2;
+	}
+	if (tok_is(&tok[0], "md")) {
+		tok += 2; ntok -= 2;
+		quiet = meta_has(tok, ntok, 'q');
+		conn_flush(conn);
+		item = kv_lookup(kv, key->s, key->len, &slot);
+		if (item == NULL) {
+			if (!quiet) conn_outs(conn, "NF\r\n");
+			return line_len;
+		}
+		kv_delete_at(kv, &slot, item);
+		if (!quiet) {
+			conn_copy(conn, "HD", 2);
+			conn_meta_flags(conn, tok, ntok, key, NULL);
+			conn_copy(conn, "\r\n", 2);
+		}
+		return line_len;
+	}
+	if (tok_is(&tok[0], "ma")) {
+		u64 delta = 1, res = 0;
+		int incr = 1, r, m;
+		tok += 2; ntok -= 2;
+		quiet = meta_has(tok, ntok, 'q');
+		if ((m = meta_has(tok, ntok, 'D')) != 0 &&
+				!tok_u64(tok[m-1].s + 1, tok[m-1].len - 1, &delta)) {
+			conn_outs(conn, "CLIENT_ERROR bad token in command line format\r\n");
+			return line_len;
+		}
+		if ((m = meta_has(tok, ntok, 'M')) != 0 && tok[m-1].len > 1) {
+			char c = tok[m-1].s[1];
+			incr = !(c == 'D' || c == 'd' || c == '-');
+		}
+		conn_flush(conn);
+		r = server_arith(kv, key, incr, delta, &res);
+		if (r == ARITH_NAN) {
+			conn_outs(conn, "CLIENT_ERROR cannot increment or decrement non-numeric value\r\n");
+		} else if (r == ARITH_NOMEM) {
+			conn_outs(conn, "SERVER_ERROR out of memory\r\n");
+		} else if (r == ARITH_MISS) {
+			if (!quiet) conn_outs(conn, "NF\r\n");
+		} else if (meta_has(tok, ntok, 'v')) {
+			char buf[24];
+			int n = snprintf(buf, sizeof(buf), "%llu", res);
+			conn_copy(conn, "VA ", 3);
+			conn_copy_u64(conn, n);
+			conn_meta_flags(conn, tok, ntok, key, NULL);
+			conn_copy(conn, "\r\n", 2);
+			conn_copy(conn, buf, n);
+			conn_copy(conn, "\r\n", 2);
+		} else if (!quiet) {
+			conn_copy(conn, "HD", 2);
+			conn_meta_flags(conn, tok, ntok, key, NULL);
+			conn_copy(conn, "\r\n", 2);
+		}
+		return line_len;
+	}
+	conn_outs(conn, "ERROR\r\n");
+	return line_len;
+}
+
+static void
+conn_process(kv_server* srv, kv_conn* conn) {
+	inmemory_kv* kv;
+	token tok[CONN_TOKENS];
+	size_t pos = 0, used;
+	int ntok, is_get;
+	TypedData_Get_Struct(srv->table, inmemory_kv, &InMemoryKV_data_type, kv);
+	if (kv->busy) {
+		srv->deferred = 1;
+		return;
+	}
+	while (!conn->closing && conn_pending(conn) < CONN_WBUF_MAX) {
+		char* line = conn->rbuf + pos;
+		char* nl;
+		if (conn->skip) {
+			used = conn->rlen - pos < conn->skip ? conn->rlen - pos : conn->skip;
+			conn->skip -= used;
+			pos += used;
+			if (conn->skip)
+				break;
+			continue;
+		}
+		nl = memchr(line, '\n', conn->rlen - pos);
+		if (nl == NULL) {
+			if (conn->rlen - pos > CONN_LINE_MAX) {
+				conn_outs(conn, "CLIENT_ERROR line too long\r\n");
+				conn->closing = 1;
+			}
+			break;
+		}
+		ntok = tokenize(line, nl - line + 1, tok, CONN_TOKENS);
+		is_get = ntok > 0 && (tok_is(&tok[0], "get") || tok_is(&tok[0], "gets"));
+		if (ntok == 0) {
+			conn_outs(conn, "ERROR\r\n");
+			used = nl - line + 1;
+		} else if (!is_get && nl - line + 1 > CONN_LINE_MAX) {
+			/* whole line could arrive at once, so it is checked here too */
+			conn_outs(conn, "CLIENT_ERROR line too long\r\n");
+			used = nl - line + 1;
+		} else if (!is_get && ntok > CONN_TOKENS) {
+			conn_outs(conn, "CLIENT_ERROR too many tokens\r\n");
+			used = nl - line + 1;
+		} else if (tok[0].len == 2 && tok[0].s[0] == 'm') {
+			used = conn_meta_command(kv, conn, tok, ntok, line, nl - line + 1, conn->rlen - pos);
+		} else {
+			/* only get gets here with more tokens, it walks line itself */
+			if (ntok > CONN_TOKENS) ntok = CONN_TOKENS;
+			used = conn_text_command(kv, conn, tok, ntok, line, nl - line + 1, conn->rlen - pos);
+		}
+		if (used == 0)
+			break;
+		pos += used;
+		if (conn->eof)
+			break;
+	}
+	conn_flush(conn);
+	if (pos > 0) {
+		memmove(conn->rbuf, conn->rbuf + pos, conn->rlen - pos);
+		conn->rlen -= pos;
+	}
+}
+
+static void
+conn_read(kv_conn* conn) {
+	ssize_t n;
+	while (conn->rlen < CONN_READ_MAX) {
+		if (conn->ralloced - conn->rlen < 4096) {
+			size_t new_alloced = conn->ralloced ? conn->ralloced * 2 : 16384;
+			char* new_rbuf = realloc(conn->rbuf, new_alloced);
+			if (new_rbuf == NULL) {
+				conn->closing = 1;
+				return;
+			}
+			conn->rbuf = new_rbuf;
+			conn->ralloced = new_alloced;
+		}
+		n = read(conn->fd, conn->rbuf + conn->rlen, conn->ralloced - conn->rlen);
+		if (n > 0) {
+			conn->rlen += n;
+		} else if (n == 0) {
+			conn->eof = 1;
+			return;
+		} else if (errno != EINTR) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				conn->closing = 1;
+			return;
+		}
+	}
+}
+
+static void
+conn_close(kv_server* srv, kv_conn* conn) {
+	epoll_ctl(srv->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	conn->prev->next = conn->next;
+	conn->next->prev = conn->prev;
+	free(conn->rbuf);
+	free(conn->wbuf);
+	free(conn);
+}
+
+static void
+conn_event(kv_server* srv, kv_conn* conn, u32 events) {
+	u32 want;
+	if (events & EPOLLERR) {
+		conn_close(srv, conn);
+		return;
+	}
+	if (events & EPOLLOUT)
+		conn_write_pending(conn);
+	if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))
+		conn_read(conn);
+	conn_process(srv, conn);
+	if (conn->closing || (conn->eof && conn_pending(conn) == 0)) {
+		conn_close(srv, conn);
+		return;
+	}
+	if (conn_pending(conn) >= CONN_WBUF_MAX || conn->eof)
+		want = EPOLLOUT;
+	else if (conn_pending(conn) > 0)
+		want = EPOLLIN | EPOLLOUT;
+	else
+		want = EPOLLIN;
+	if (want != conn->events) {
+		struct epoll_event ev;
+		ev.events = want;
+		ev.data.ptr = conn;
+		epoll_ctl(srv->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+		conn->events = want;
+	}
+}
+
+static void
+server_accept(kv_server* srv) {
+	struct epoll_event ev;
+	kv_conn* conn;
+	int fd, one = 1;
+	for (;;) {
+		fd = accept4(srv->lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR) continue;
+			return;
+		}
+		/* fails harmlessly on unix socket */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		conn = calloc(1, sizeof(kv_conn));
+		if (conn == NULL) {
+			close(fd);
+			continue;
+		}
+		conn->fd = fd;
+		conn->events = EPOLLIN;
+		ev.events = EPOLLIN;
+		ev.data.ptr = conn;
+		if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			close(fd);
+			free(conn);
+			continue;
+		}
+		conn->next = srv->conns.next;
+		conn->prev = &srv->conns;
+		conn->next->prev = conn;
+		srv->conns.next = conn;
+	}
+}
+
+static void
+server_close_conns(kv_server* srv) {
+	while (srv->conns.next != &srv->conns) {
+		conn_close(srv, srv->conns.next);
+	}
+}
+
+static void
+server_wake(void* arg) {
+	kv_server* srv = arg;
+	char c = 0;
+	ssize_t r = write(srv->wake[1], &c, 1);
+	(void)r; /* pipe is full, so server is woken already */
+}
+
+static void
+server_drain_wake(kv_server* srv) {
+	char buf[64];
+	while (read(srv->wake[0], buf, sizeof(buf)) > 0);
+}
+
+struct server_wait {
+	kv_server* srv;
+	struct epoll_event events[SERVER_EVENTS];
+	int n;
+	int err;
+	int timeout;
+};
+
+static void*
+server_wait(void* arg) {
+	struct server_wait* w = arg;
+	w->n = epoll_wait(w->srv->epfd, w->events, SERVER_EVENTS, w->timeout);
+	w->err = errno;
+	return NULL;
+}
+
+static VALUE
+server_loop(VALUE arg) {
+	kv_server* srv = (kv_server*)arg;
+	struct server_wait w;
+	int i;
+	w.srv = srv;
+	while (!srv->stop) {
+		int deferred = srv->deferred;
+		srv->deferred = 0;
+		w.timeout = deferred ? 1 : -1;
+		rb_thread_call_without_gvl(server_wait, &w, server_wake, srv);
+		rb_thread_check_ints();
+		if (w.n < 0) {
+			if (w.err == EINTR) continue;
+			errno = w.err;
+			rb_sys_fail("epoll_wait");
+		}
+		for (i = 0; i < w.n; i++) {
+			void* ptr = w.events[i].data.ptr;
+			if (ptr == &srv->lfd)
+				server_accept(srv);
+			else if (ptr == srv->wake)
+				server_drain_wake(srv);
+			else
+				conn_event(srv, ptr, w.events[i].events);
+		}
+		if (deferred) {
+			kv_conn *conn, *next;
+			for (conn = srv->conns.next; conn != &srv->conns; conn = next) {
+				next = conn->next;
+				if (conn->rlen > 0)
+					conn_event(srv, conn, 0);
+			}
+		}
+	}
+	return Qnil;
+}
+
+static VALUE
+server_loop_ensure(VALUE arg) {
+	kv_server* srv = (kv_server*)arg;
+	server_close_conns(srv);
+	srv->running = 0;
+	return Qnil;
+}
+
+static void
+rb_server_mark(void *p) {
+	kv_server* srv = p;
+	rb_gc_mark(srv->table);
+	rb_gc_mark(srv->listener);
+}
+
+static void
+rb_server_free(void *p) {
+	kv_server* srv = p;
+	if (srv->conns.next != NULL)
+		server_close_conns(srv);
+	if (srv->epfd >= 0) close(srv->epfd);
+	if (srv->wake[0] >= 0) close(srv->wake[0]);
+	if (srv->wake[1] >= 0) close(srv->wake[1]);
+	free(srv);
+}
+
+static size_t
+rb_server_memsize(const void *p) {
+	const kv_server* srv = p;
+	const kv_conn* conn;
+	size_t size = sizeof(*srv);
+	if (srv->conns.next == NULL) return size;
+	for (conn = srv->conns.next; conn != &srv->conns; conn = conn->next) {
+		size += sizeof(*conn) + conn->ralloced + conn->walloced;
+	}
+	return size;
+}
+
+static const rb_data_type_t Server_data_type = {
+	"InMemoryKV::Server",
+	{rb_server_mark, rb_server_free, rb_server_memsize}
+};
+#define GetServer(value, pointer) \
+	TypedData_Get_Struct((value), kv_server, &Server_data_type, (pointer))
+
+static VALUE
+rb_server_alloc(VALUE klass) {
+	kv_server* srv = calloc(1, sizeof(kv_server));
+	srv->table = Qnil;
+	srv->listener = Qnil;
+	srv->lfd = srv->epfd = srv->wake[0] = srv->wake[1] = -1;
+	return TypedData_Wrap_Struct(klass, &Server_data_type, srv);
+}
+
+static VALUE
+rb_server_init(VALUE self, VALUE table, VALUE listener) {
+	kv_server* srv;
+	struct epoll_event ev;
+	int fl;
+
+	GetServer(self, srv);
+	Check_TypedStruct(table, &InMemoryKV_data_type);
+	if (srv->epfd >= 0)
+		rb_raise(rb_eRuntimeError, "server is already initialized");
+	srv->table = table;
+	srv->listener = listener;
+	srv->lfd = NUM2INT(rb_funcall(listener, rb_intern("fileno"), 0));
+	fl = fcntl(srv->lfd, F_GETFL);
+	if (fl < 0 || fcntl(srv->lfd, F_SETFL, fl | O_NONBLOCK) < 0)
+		rb_sys_fail("fcntl");
+	srv->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (srv->epfd < 0)
+		rb_sys_fail("epoll_create1");
+	if (pipe2(srv->wake, O_NONBLOCK | O_CLOEXEC) < 0)
+		rb_sys_fail("pipe2");
+	ev.events = EPOLLIN;
+	ev.data.ptr = &srv->lfd;
+	if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->lfd, &ev) < 0)
+		rb_sys_fail("epoll_ctl");
+	ev.data.ptr = srv->wake;
+	if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->wake[0], &ev) < 0)
+		rb_sys_fail("epoll_ctl");
+	srv->conns.next = srv->conns.prev = &srv->conns;
+	return self;
+}
+
+static VALUE
+rb_server_run(VALUE self) {
+	kv_server* srv;
+	GetServer(self, srv);
+	if (srv->epfd < 0)
+		rb_raise(rb_eRuntimeError, "server is not initialized");
+	if (srv->running)
+		rb_raise(rb_eRuntimeError, "server is already running");
+	srv->running = 1;
+	srv->stop = 0;
+	rb_ensure(server_loop, (VALUE)srv, server_loop_ensure, (VALUE)srv);
+	return self;
+}
+
+static VALUE
+rb_server_shutdown(VALUE self) {
+	kv_server* srv;
+	GetServer(self, srv);
+	if (srv->running) {
+		srv->stop = 1;
+		server_wake(srv);
+	}
+	return self;
+}
+
+static VALUE
+rb_server_running_p(VALUE self) {
+	kv_server* srv;
+	GetServer(self, srv);
+	return srv->running ? Qtrue : Qfalse;
+}
+
+static VALUE
+rb_server_table(VALUE self) {
+	kv_server* srv;
+	GetServer(self, srv);
+	return srv->table;
+}
+
+static VALUE
+rb_server_listener(VALUE self) {
+	kv_server* srv;
+	GetServer(self, srv);
+	return srv->listener;
+}
+#endif
+
+void
+Init_inmemory_kv() {
+	VALUE mod_inmemory_kv, cls_str2str, cls_namespaced;
+#ifdef HAVE_SYS_EPOLL_H
+	VALUE cls_server;
+#endif
+
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+	/* global state (item_refs, lazy_free) is guarded by mutexes */
+	rb_ext_ractor_safe(1);
+#endif
+	pthread_atfork(kv_atfork_prepare, kv_atfork_parent, kv_atfork_child);
+	mod_inmemory_kv = rb_define_module("InMemoryKV");
+	rb_define_module_function(mod_inmemory_kv, "lazy_free_threshold", rb_lazy_free_threshold, 0);
+	rb_define_module_function(mod_inmemory_kv, "lazy_free_threshold=", rb_lazy_free_set_threshold, 1);
+	rb_define_module_function(mod_inmemory_kv, "lazy_free_pending", rb_lazy_free_pending, 0);
+	rb_define_module_function(mod_inmemory_kv, "threads", rb_parallel_threads, 0);
+	rb_define_module_function(mod_inmemory_kv, "threads=", rb_parallel_set_threads, 1);
+
+	cls_str2str = rb_define_class_under(mod_inmemory_kv, "Str2Str", rb_cObject);
+	rb_define_alloc_func(cls_str2str, rb_kv_alloc);
+	rb_define_method(cls_str2str, "[]", rb_kv_get, 1);
+	rb_define_method(cls_str2str, "up", rb_kv_up, 1);
+	rb_define_method(cls_str2str, "down", rb_kv_down, 1);
+	rb_define_method(cls_str2str, "[]=", rb_kv_set, 2);
+	rb_define_method(cls_str2str, "unshift", rb_kv_unshift, 2);
+	rb_define_method(cls_str2str, "delete", rb_kv_del, 1);
+	rb_define_method(cls_str2str, "set_if_absent", rb_kv_set_if_absent, 2);
+	rb_define_method(cls_str2str, "getset", rb_kv_getset, 2);
+	rb_define_method(cls_str2str, "cas", rb_kv_cas, 3);
+	rb_define_method(cls_str2str, "fetch_or_store", rb_kv_fetch_or_store, -1);
+	rb_define_method(cls_str2str, "update", rb_kv_update, 1);
+	rb_define_method(cls_str2str, "append", rb_kv_append, 2);
+	rb_define_method(cls_str2str, "prepend", rb_kv_prepend, 2);
+	rb_define_method(cls_str2str, "setrange", rb_kv_setrange, 3);
+	rb_define_method(cls_str2str, "truncate", rb_kv_truncate, 2);
+	rb_define_method(cls_str2str, "empty?", rb_kv_empty_p, 0);
+	rb_define_method(cls_str2str, "size", rb_kv_size, 0);
+	rb_define_method(cls_str2str, "count", rb_kv_size, 0);
+	rb_define_method(cls_str2str, "data_size", rb_kv_data_size, 0);
+	rb_define_method(cls_str2str, "total_size", rb_kv_total_size, 0);
+	rb_define_method(cls_str2str, "include?", rb_kv_include, 1);
+	rb_define_method(cls_str2str, "has_key?", rb_kv_include, 1);
+	rb_define_method(cls_str2str, "first", rb_kv_first, 0);
+	rb_define_method(cls_str2str, "shift", rb_kv_shift, 0);
+	rb_define_method(cls_str2str, "keys", rb_kv_keys, 0);
+	rb_define_method(cls_str2str, "values", rb_kv_vals, 0);
+	rb_define_method(cls_str2str, "entries", rb_kv_entries, 0);
+	rb_define_method(cls_str2str, "each_key", rb_kv_each_key, 0);
+	rb_define_method(cls_str2str, "each_value", rb_kv_each_val, 0);
+	rb_define_method(cls_str2str, "each_pair", rb_kv_each, 0);
+	rb_define_method(cls_str2str, "each", rb_kv_each, 0);
+	rb_define_method(cls_str2str, "inspect", rb_kv_inspect, 0);
+	rb_define_method(cls_str2str, "initialize_copy", rb_kv_init_copy, 1);
+	rb_define_method(cls_str2str, "clear", rb_kv_clear, -1);
+	rb_define_method(cls_str2str, "track_changes", rb_kv_track_changes, -1);
+	rb_define_method(cls_str2str, "tracking_changes?", rb_kv_tracking_changes_p, 0);
+	rb_define_method(cls_str2str, "change_seq", rb_kv_change_seq, 0);
+	rb_define_method(cls_str2str, "applied_seq", rb_kv_applied_seq, 0);
+	rb_define_method(cls_str2str, "snapshot_pending?", rb_kv_snapshot_pending_p, 0);
+	rb_define_method(cls_str2str, "take_changes", rb_kv_take_changes, 0);
+	rb_define_method(cls_str2str, "snapshot", rb_kv_snapshot, 0);
+	rb_define_method(cls_str2str, "apply_changes", rb_kv_apply_changes, 1);
+	rb_define_method(cls_str2str, "reserve", rb_kv_reserve, 1);
+	rb_define_method(cls_str2str, "freeze_compact", rb_kv_freeze_compact, 0);
+	rb_define_method(cls_str2str, "track_hot_keys", rb_kv_track_hot_keys, -1);
+	rb_define_method(cls_str2str, "tracking_hot_keys?", rb_kv_tracking_hot_keys_p, 0);
+	rb_define_method(cls_str2str, "reset_hot_keys", rb_kv_reset_hot_keys, 0);
+	rb_define_method(cls_str2str, "hot_keys", rb_kv_hot_keys, -1);
+	rb_define_method(cls_str2str, "largest_items", rb_kv_largest_items, -1);
+	rb_define_private_method(cls_str2str, "bulk_load_chunk", rb_kv_bulk_load_chunk, 3);
+	rb_include_module(cls_str2str, rb_mEnumerable);
+
+	cls_frozen = rb_define_class_under(mod_inmemory_kv, "Frozen", rb_cObject);
+	rb_undef_alloc_func(cls_frozen);
+	rb_define_singleton_method(cls_frozen, "load", rb_frozen_s_load, 1);
+	rb_define_method(cls_frozen, "[]", rb_frozen_get, 1);
+	rb_define_method(cls_frozen, "include?", rb_frozen_include, 1);
+	rb_define_method(cls_frozen, "has_key?", rb_frozen_include, 1);
+	rb_define_method(cls_frozen, "size", rb_frozen_size, 0);
+	rb_define_method(cls_frozen, "count", rb_frozen_size, 0);
+	rb_define_method(cls_frozen, "empty?", rb_frozen_empty_p, 0);
+	rb_define_method(cls_frozen, "bytesize", rb_frozen_bytesize, 0);
+	rb_define_method(cls_frozen, "dump", rb_frozen_dump, 0);
+	rb_define_method(cls_frozen, "keys", rb_frozen_keys, 0);
+	rb_define_method(cls_frozen, "values", rb_frozen_vals, 0);
+	rb_define_method(cls_frozen, "entries", rb_frozen_entries, 0);
+	rb_define_method(cls_frozen, "each_key", rb_frozen_each_key, 0);
+	rb_define_method(cls_frozen, "each_value", rb_frozen_each_val, 0);
+	rb_define_method(cls_frozen, "each_pair", rb_frozen_each, 0);
+	rb_define_method(cls_frozen, "each", rb_frozen_each, 0);
+	rb_include_module(cls_frozen, rb_mEnumerable);
+
+	cls_namespaced = rb_define_class_under(mod_inmemory_kv, "Namespaced", rb_cObject);
+	rb_define_alloc_func(cls_namespaced, rb_nkv_alloc);
+	rb_define_method(cls_namespaced, "get", rb_nkv_get, 2);
+	rb_define_method(cls_namespaced, "set", rb_nkv_set, 3);
+	rb_define_method(cls_namespaced, "up", rb_nkv_up, 2);
+	rb_define_method(cls_namespaced, "down", rb_nkv_down, 2);
+	rb_define_method(cls_namespaced, "delete", rb_nkv_del, 2);
+	rb_define_method(cls_namespaced, "include?", rb_nkv_include, 2);
+	rb_define_method(cls_namespaced, "has_key?", rb_nkv_include, 2);
+	rb_define_method(cls_namespaced, "first", rb_nkv_first, 1);
+	rb_define_method(cls_namespaced, "shift", rb_nkv_shift, 1);
+	rb_define_method(cls_namespaced, "size", rb_nkv_size, -1);
+	rb_define_method(cls_namespaced, "count", rb_nkv_size, -1);
+	rb_define_method(cls_namespaced, "data_size", rb_nkv_data_size, -1);
+	rb_define_method(cls_namespaced, "total_size", rb_nkv_total_size, 0);
+	rb_define_method(cls_namespaced, "quota", rb_nkv_quota, 1);
+	rb_define_method(cls_namespaced, "set_quota", rb_nkv_set_quota, 2);
+	rb_define_method(cls_namespaced, "clear", rb_nkv_clear, -1);
+	rb_define_method(cls_namespaced, "namespaces", rb_nkv_namespaces, 0);
+	rb_define_method(cls_namespaced, "keys", rb_nkv_keys, 1);
+	rb_define_method(cls_namespaced, "values", rb_nkv_vals, 1);
+	rb_define_method(cls_namespaced, "entries", rb_nkv_entries, 1);
+	rb_define_method(cls_namespaced, "each_key", rb_nkv_each_key, 1);
+	rb_define_method(cls_namespaced, "each_value", rb_nkv_each_val, 1);
+	rb_define_method(cls_namespaced, "each_pair", rb_nkv_each, 1);
+	rb_define_method(cls_namespaced, "each", rb_nkv_each, 1);
+	rb_define_method(cls_namespaced, "initialize_copy", rb_nkv_init_copy, 1);
+
+#ifdef HAVE_SYS_EPOLL_H
+	cls_server = rb_define_class_under(mod_inmemory_kv, "Server", rb_cObject);
+	rb_define_alloc_func(cls_server, rb_server_alloc);
+	rb_define_method(cls_server, "initialize", rb_server_init, 2);
+	rb_define_method(cls_server, "run", rb_server_run, 0);
+	rb_define_method(cls_server, "shutdown", rb_server_shutdown, 0);
+	rb_define_method(cls_server, "running?", rb_server_running_p, 0);
+	rb_define_method(cls_server, "table", rb_server_table, 0);
+	rb_define_method(cls_server, "listener", rb_server_listener, 0);
+#endif
 }
@@ -2,5 +2,57 @@ require "inmemory_kv.so"
 require "inmemory_kv/version"
 
 module InMemoryKV
-  # Your code goes here...
+  class Str2Str
+    # Writes pending change records to io (pipe or socket).
+    # Returns number of bytes written.
+    def flush_changes(io)
+      chunk = take_changes
+      io.write(chunk) unless chunk.empty?
+      chunk.bytesize
+    end
+
+    # Applies change records read from io until EOF.
+    # Feed it with `snapshot` first, then with `flush_changes` of leader.
+    def follow(io, chunk_size = 65536)
+      buf = ''.b
+      loop do
+        buf << io.readpartial(chunk_size)
+        applied = apply_changes(buf)
+        # big record arrives in many chunks, don't copy buffer for each one
+        buf = buf.byteslice(applied, buf.bytesize - applied) if applied > 0
+      end
+    rescue EOFError
+      raise ArgumentError, "truncated change feed" unless buf.empty? && !snapshot_pending?
+      self
+    end
+
+    # Loads records from String or IO without GVL and without creating
+    # Ruby strings per record. Formats:
+    #  :tsv - "key\tvalue\n" lines
+    #  :length_prefixed - 32bit little-endian key and value sizes, key, value
+    # Returns number of loaded records.
+    def bulk_load(src, format: :tsv, chunk_size: 1 << 20)
+      return bulk_load_chunk(src, format, true)[1] if src.is_a?(String)
+      loaded = 0
+      buf = ''.b
+      while chunk = src.read(chunk_size)
+        buf << chunk
+        consumed, n = bulk_load_chunk(buf, format, false)
+        loaded += n
+        buf = buf.byteslice(consumed, buf.bytesize - consumed)
+      end
+      loaded + bulk_load_chunk(buf, format, true)[1]
+    end
+  end
+
+  class Frozen
+    # Writes blob to path, so it could be mmapped back with Frozen.load.
+    def save(path)
+      File.binwrite(path, dump)
+      self
+    end
+  end
 end
+
+require "inmemory_kv/namespaced"
+require "inmemory_kv/server" if defined?(InMemoryKV::Server)
@@ -0,0 +1,108 @@
+module InMemoryKV
+  class Namespaced
+    # Returns Str2Str-like view of one namespace.
+    def [](ns)
+      Table.new(self, ns)
+    end
+
+    class Table
+      include Enumerable
+      attr_reader :store, :ns
+
+      def initialize(store, ns)
+        @store = store
+        @ns = ns
+      end
+
+      def [](key)
+        @store.get(@ns, key)
+      end
+
+      def []=(key, val)
+        @store.set(@ns, key, val)
+      end
+
+      def up(key)
+        @store.up(@ns, key)
+      end
+
+      def down(key)
+        @store.down(@ns, key)
+      end
+
+      def delete(key)
+        @store.delete(@ns, key)
+      end
+
+      def include?(key)
+        @store.include?(@ns, key)
+      end
+      alias has_key? include?
+
+      def first
+        @store.first(@ns)
+      end
+
+      def shift
+        @store.shift(@ns)
+      end
+
+      def size
+        @store.size(@ns)
+      end
+      alias count size
+
+      def empty?
+        size == 0
+      end
+
+      def data_size
+        @store.data_size(@ns)
+      end
+
+      def quota
+        @store.quota(@ns)
+      end
+
+      def quota=(bytes)
+        @store.set_quota(@ns, bytes)
+      end
+
+      def clear
+        @store.clear(@ns)
+        self
+      end
+
+      def keys
+        @store.keys(@ns)
+      end
+
+      def values
+        @store.values(@ns)
+      end
+
+      def entries
+        @store.entries(@ns)
+      end
+
+      def each_key(&block)
+        return enum_for(:each_key) unless block
+        @store.each_key(@ns, &block)
+        self
+      end
+
+      def each_value(&block)
+        return enum_for(:each_value) unless block
+        @store.each_value(@ns, &block)
+        self
+      end
+
+      def each(&block)
+        return enum_for(:each) unless block
+        @store.each(@ns, &block)
+        self
+      end
+      alias each_pair each
+    end
+  end
+end
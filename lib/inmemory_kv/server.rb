@@ -0,0 +1,35 @@
+require 'socket'
+
+module InMemoryKV
+  # Memcached text/meta protocol frontend for Str2Str.
+  # Flags are not stored (always 0) and exptime is ignored.
+  class Server
+    # Listens on unix socket if `unix:` path given, on tcp host:port otherwise.
+    def self.start(table, host: '127.0.0.1', port: 11211, unix: nil)
+      listener = unix ? UNIXServer.new(unix) : TCPServer.new(host, port)
+      new(table, listener).start
+    end
+
+    # Runs event loop in background thread.
+    def start
+      @thread = Thread.new { run }
+      self
+    end
+
+    def stop
+      shutdown
+      @thread.join if @thread
+      @thread = nil
+      self
+    end
+
+    def close
+      stop
+      listener.close unless listener.closed?
+    end
+
+    def address
+      listener.local_address
+    end
+  end
+end
@@ -0,0 +1,70 @@
+require 'inmemory_kv'
+require 'tempfile'
+require 'minitest/spec'
+require 'minitest/autorun'
+
+describe InMemoryKV::Frozen do
+  let(:s2s) { InMemoryKV::Str2Str.new }
+  let(:num) { 1000 }
+  let(:frozen) { s2s.freeze_compact }
+  before do
+    num.times { |i| s2s[i.to_s] = "q#{i}" }
+    s2s.up('5')
+  end
+  it "should fetch all keys" do
+    frozen.size.must_equal num
+    num.times { |i| frozen[i.to_s].must_equal "q#{i}" }
+    frozen['nokey'].must_be_nil
+    frozen.include?('7').must_equal true
+    frozen.has_key?('-1').must_equal false
+  end
+  it "should keep LRU order of source" do
+    frozen.entries.must_equal s2s.entries
+    frozen.keys.must_equal s2s.keys
+    frozen.values.must_equal s2s.values
+    frozen.each_key.first.must_equal '0'
+    frozen.to_a.last.must_equal ['5', 'q5']
+  end
+  it "should be independent from source" do
+    f = frozen
+    s2s['0'] = 'changed'
+    s2s.clear
+    f['0'].must_equal 'q0'
+    f.frozen?.must_equal true
+  end
+  it "should handle empty table and odd keys" do
+    e = InMemoryKV::Str2Str.new.freeze_compact
+    e.size.must_equal 0
+    e.empty?.must_equal true
+    e['a'].must_be_nil
+    e.entries.must_equal []
+    s2s[''] = 'empty'
+    s2s['x' * 1000] = 'y' * 1000
+    frozen[''].must_equal 'empty'
+    frozen['x' * 1000].must_equal 'y' * 1000
+  end
+  it "should be saved and mmapped back" do
+    Tempfile.create('frozen') do |f|
+      f.close
+      frozen.save(f.path).must_be_same_as frozen
+      loaded = InMemoryKV::Frozen.load(f.path)
+      loaded.bytesize.must_equal frozen.bytesize
+      loaded.entries.must_equal frozen.entries
+      loaded['42'].must_equal 'q42'
+    end
+  end
+  it "should reject garbage" do
+    Tempfile.create('frozen') do |f|
+      f.write(frozen.dump[0, 100])
+      f.close
+      proc { InMemoryKV::Frozen.load(f.path) }.must_raise ArgumentError
+    end
+  end
+  it "should be shareable between ractors" do
+    skip unless defined?(Ractor)
+    Ractor.shareable?(frozen).must_equal true
+    f = frozen
+    r = Warning.stub(:warn, nil) { Ractor.new(f) { |x| x['3'] } }
+    r.take.must_equal 'q3'
+  end
+end
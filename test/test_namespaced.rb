@@ -0,0 +1,64 @@
+require 'inmemory_kv'
+require 'minitest/spec'
+require 'minitest/autorun'
+
+describe InMemoryKV::Namespaced do
+  let(:store) { InMemoryKV::Namespaced.new }
+  let(:t1) { store[1] }
+  let(:t2) { store[2] }
+  before do
+    t1['asdf'] = 'qwer'
+    t1['qwer'] = 'zxcv'
+    t2['asdf'] = 'yuio'
+  end
+  it "should separate namespaces" do
+    t1['asdf'].must_equal 'qwer'
+    t2['asdf'].must_equal 'yuio'
+    t2['qwer'].must_be_nil
+    store[3]['asdf'].must_be_nil
+    store.get(100000, 'asdf').must_be_nil
+  end
+  it "should reject negative and too large ids" do
+    proc { store.set(-1, 'k', 'v') }.must_raise(ArgumentError).message.must_match(/negative/)
+    proc { store.set(1 << 17, 'k', 'v') }.must_raise(ArgumentError).message.must_match(/too large/)
+    store.set((1 << 17) - 1, 'k', 'v')
+    store.namespaces.must_equal [1, 2, (1 << 17) - 1]
+  end
+  it "should account per namespace" do
+    t1.size.must_equal 2
+    t2.size.must_equal 1
+    store.size.must_equal 3
+    (t1.data_size + t2.data_size).must_equal store.data_size
+    store.namespaces.must_equal [1, 2]
+  end
+  it "should iterate namespace in LRU order" do
+    t1.entries.must_equal [['asdf', 'qwer'], ['qwer', 'zxcv']]
+    t1.up 'asdf'
+    t1.keys.must_equal ['qwer', 'asdf']
+    t2.map{|k, v| k}.must_equal ['asdf']
+    t1.first.must_equal ['qwer', 'zxcv']
+  end
+  it "should clear one namespace" do
+    t1.clear
+    t1.must_be_empty
+    t1.data_size.must_equal 0
+    t2['asdf'].must_equal 'yuio'
+    store.clear
+    store.size.must_equal 0
+    t2.must_be_empty
+  end
+  it "should evict namespace over quota" do
+    t2.quota = t2.data_size * 2
+    10.times { |i| t2["k#{i}"] = 'v' }
+    t2.data_size.must_be :<=, t2.quota
+    t2.keys.last.must_equal 'k9'
+    t2['asdf'].must_be_nil
+    t1.size.must_equal 2
+  end
+  it "should dup" do
+    copy = store.dup
+    t1['asdf'] = 'new'
+    copy.get(1, 'asdf').must_equal 'qwer'
+    copy.size(1).must_equal 2
+  end
+end
@@ -0,0 +1,82 @@
+require 'inmemory_kv'
+require 'minitest/spec'
+require 'minitest/autorun'
+
+describe "InMemoryKV::Server" do
+  let(:s2s) { InMemoryKV::Str2Str.new }
+  before do
+    skip "no epoll" unless defined?(InMemoryKV::Server)
+    @server = InMemoryKV::Server.start(s2s, port: 0)
+    @sock = TCPSocket.new('127.0.0.1', @server.address.ip_port)
+  end
+  after do
+    @sock.close if @sock
+    @server.close if @server
+  end
+
+  def request(str, lines = 1)
+    @sock.write(str)
+    Array.new(lines) { @sock.gets }.join
+  end
+
+  it "should set and get" do
+    request("set asdf 0 0 4\r\nqwer\r\n").must_equal "STORED\r\n"
+    s2s['asdf'].must_equal 'qwer'
+    request("get asdf zxcv\r\n", 3).must_equal "VALUE asdf 0 4\r\nqwer\r\nEND\r\n"
+  end
+  it "should get more keys than tokens limit" do
+    keys = Array.new(30) { |i| "k#{i}" }
+    keys.each { |k| s2s[k] = k }
+    request("get #{keys.join(' ')}\r\n", 61).must_equal(
+      keys.map { |k| "VALUE #{k} 0 #{k.size}\r\n#{k}\r\n" }.join + "END\r\n")
+    request("delete #{keys.join(' ')}\r\n").must_equal "CLIENT_ERROR too many tokens\r\n"
+    s2s.size.must_equal 30
+  end
+  it "should refuse value larger than read buffer and stay usable" do
+    size = 5 << 20
+    request("set big 0 0 #{size}\r\n" + 'x' * size + "\r\nset a 0 0 1\r\nb\r\n", 2).must_equal(
+      "SERVER_ERROR object too large for cache\r\nSTORED\r\n")
+    request("ms big #{size}\r\n" + 'y' * size + "\r\nmn\r\n", 2).must_equal(
+      "SERVER_ERROR object too large for cache\r\nMN\r\n")
+    s2s.include?('big').must_equal false
+    s2s['a'].must_equal 'b'
+  end
+  it "should refuse long lines and opaque tokens" do
+    request("ms a 1 O#{'x' * 20000}\r\nb\r\nmn\r\n", 3).must_equal(
+      "CLIENT_ERROR line too long\r\nERROR\r\nMN\r\n")
+    request("ms a 1 O#{'x' * 33}\r\nb\r\nmg a O#{'y' * 33}\r\nmn\r\n", 3).must_equal(
+      "CLIENT_ERROR opaque token too long\r\n" * 2 + "MN\r\n")
+    request("mg a O#{'y' * 32}\r\n").must_equal "EN\r\n"
+    s2s.include?('a').must_equal false
+  end
+  it "should keep pipelined replies intact past iovec limit" do
+    s2s['a'] = '1'
+    request("mg a v\r\n" + "mg missing v\r\n" * 61 + "mg a v k\r\n", 65).must_equal(
+      "VA 1\r\n1\r\n" + "EN\r\n" * 61 + "VA 1 ka\r\n1\r\n")
+  end
+  it "should serve pipelined commands" do
+    s2s['a'] = '1'
+    s2s['b'] = '22'
+    request("get a\r\nget b\r\ndelete a\r\nget a\r\n", 8).must_equal(
+      "VALUE a 0 1\r\n1\r\nEND\r\nVALUE b 0 2\r\n22\r\nEND\r\nDELETED\r\nEND\r\n")
+    s2s.include?('a').must_equal false
+  end
+  it "should add, replace and append" do
+    request("add a 0 0 1\r\nx\r\nadd a 0 0 1\r\ny\r\n", 2).must_equal "STORED\r\nNOT_STORED\r\n"
+    request("replace b 0 0 1\r\nx\r\nappend a 0 0 2\r\nyz\r\n", 2).must_equal "NOT_STORED\r\nSTORED\r\n"
+    s2s['a'].must_equal 'xyz'
+  end
+  it "should incr and decr" do
+    s2s['n'] = '10'
+    request("incr n 5\r\ndecr n 20\r\nincr m 1\r\n", 3).must_equal "15\r\n0\r\nNOT_FOUND\r\n"
+    s2s['n'].must_equal '0'
+  end
+  it "should speak meta protocol" do
+    request("ms a 3\r\nabc\r\n").must_equal "HD\r\n"
+    request("mg a s v k\r\n", 2).must_equal "VA 3 s3 ka\r\nabc\r\n"
+    request("mg b v\r\n").must_equal "EN\r\n"
+    request("ma c\r\nms c 1\r\n7\r\nma c v\r\n", 4).must_equal "NF\r\nHD\r\nVA 1\r\n8\r\n"
+    request("md a q\r\nmn\r\n").must_equal "MN\r\n"
+    s2s.include?('a').must_equal false
+  end
+end
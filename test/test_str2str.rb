@@ -1,4 +1,5 @@
 require 'inmemory_kv'
+require 'stringio'
 require 'minitest/spec'
 require 'minitest/autorun'
 
@@ -147,6 +148,19 @@ describe InMemoryKV::Str2Str do
       s2s['qwer'].must_equal 'zxcv'
       copy['qwer'].must_equal 'zxcv'
     end
+    it "should share items between several copies" do
+      copy1 = s2s.dup
+      copy2 = copy1.dup
+      s2s.delete('asdf')
+      copy1['asdf'] = 'yuio'
+      copy2['asdf'].must_equal 'qwer'
+      copy2.delete('asdf').must_equal 'qwer'
+      copy1['asdf'].must_equal 'yuio'
+      copy2['qwer'] = 'new'
+      [s2s, copy1].each { |t| t['qwer'].must_equal 'zxcv' }
+      s2s.clear
+      copy1.shift.must_equal ['qwer', 'zxcv']
+    end
   end
 
   describe "huge filled" do
@@ -181,6 +195,17 @@ describe InMemoryKV::Str2Str do
       s2s.size.must_equal hsh.size
       s2s.entries.must_equal hsh.entries
     end
+    it "should keep sharing while copies diverge" do
+      copy = s2s.dup
+      (num - 10).times { |i| copy.delete(i.to_s) }
+      copy.entries.must_equal hsh.entries.last(10)
+      s2s.entries.must_equal hsh.entries
+      copy.clear
+      copy = s2s.dup
+      s2s['0'] = 'ya'
+      copy['0'].must_equal 'q0'
+      copy.entries.must_equal hsh.entries
+    end
     it "should reorder on set" do
       s2s.first.must_equal ['0', 'q0']
       s2s['0'] = 'ya'
@@ -195,4 +220,320 @@ describe InMemoryKV::Str2Str do
       s2s.entries.last.wont_equal ['235', 'q235']
     end
   end
+
+  describe "conditional ops" do
+    before do
+      s2s['a'] = '1'
+      s2s['b'] = '2'
+    end
+    it "should set if absent" do
+      s2s.set_if_absent('a', 'x').must_equal false
+      s2s.set_if_absent('c', '3').must_equal true
+      s2s.entries.must_equal [['a', '1'], ['b', '2'], ['c', '3']]
+    end
+    it "should getset" do
+      s2s.getset('a', 'x').must_equal '1'
+      s2s.getset('c', '3').must_be_nil
+      s2s.entries.must_equal [['b', '2'], ['a', 'x'], ['c', '3']]
+    end
+    it "should compare and set" do
+      s2s.cas('a', '2', 'x').must_equal false
+      s2s.cas('a', '1', 'x').must_equal true
+      s2s.cas('c', '1', 'x').must_equal false
+      s2s.cas('b', nil, 'x').must_equal false
+      s2s.cas('c', nil, '3').must_equal true
+      s2s.entries.must_equal [['b', '2'], ['a', 'x'], ['c', '3']]
+    end
+    it "should fetch or store" do
+      s2s.fetch_or_store('a') { flunk }.must_equal '1'
+      s2s.fetch_or_store('c') { |k| k * 2 }.must_equal 'cc'
+      s2s.fetch_or_store('d', '4').must_equal '4'
+      s2s.fetch_or_store('d', '5').must_equal '4'
+      s2s.entries.must_equal [['a', '1'], ['b', '2'], ['c', 'cc'], ['d', '4']]
+    end
+    it "should update with block" do
+      s2s.update('a') { |v| v + '0' }.must_equal '10'
+      s2s.update('c') { |v| v.must_be_nil; '3' }.must_equal '3'
+      s2s.update('b') { nil }.must_be_nil
+      s2s.update('e') { nil }.must_be_nil
+      s2s.entries.must_equal [['a', '10'], ['c', '3']]
+    end
+    it "should survive table changes in block" do
+      s2s.update('a') do |v|
+        1000.times { |i| s2s[i.to_s] = 'x' }
+        s2s.delete('b')
+        v + '0'
+      end.must_equal '10'
+      s2s.fetch_or_store('b') do
+        s2s['b'] = 'inner'
+        'outer'
+      end.must_equal 'inner'
+      s2s.update('c') { s2s.clear; '3' }.must_equal '3'
+      s2s.entries.must_equal [['c', '3']]
+    end
+  end
+
+  describe "in-place edits" do
+    before do
+      s2s['a'] = 'hello'
+      s2s['b'] = 'x'
+    end
+    it "should append and prepend" do
+      s2s.append('a', ' world').must_equal 11
+      s2s.prepend('a', '>> ').must_equal 14
+      s2s.append('c', 'new').must_equal 3
+      s2s.entries.must_equal [['b', 'x'], ['a', '>> hello world'], ['c', 'new']]
+    end
+    it "should setrange and truncate" do
+      s2s.setrange('a', 1, 'EL').must_equal 5
+      s2s['a'].must_equal 'hELlo'
+      s2s.setrange('a', 7, '!').must_equal 8
+      s2s['a'].must_equal "hELlo\0\0!"
+      s2s.setrange('c', 2, 'z').must_equal 3
+      s2s['c'].must_equal "\0\0z"
+      s2s.truncate('a', 2).must_equal 2
+      s2s['a'].must_equal 'hE'
+      s2s.truncate('b', 3).must_equal 3
+      s2s['b'].must_equal "x\0\0"
+      s2s.truncate('d', 3).must_be_nil
+      s2s.include?('d').must_equal false
+    end
+    it "should refuse sizes past the limit without wrapping" do
+      proc { s2s.setrange('a', 2**64 - 2, 'xyz') }.must_raise ArgumentError
+      proc { s2s.truncate('a', 2**64 - 1) }.must_raise ArgumentError
+      proc { s2s.setrange('c', 2**64 - 1, 'x') }.must_raise ArgumentError
+      s2s['a'].must_equal 'hello'
+      s2s.include?('c').must_equal false
+    end
+    it "should grow past small item layout and keep accounting" do
+      expect = 'hello'
+      1000.times do |i|
+        chunk = i.to_s * 3
+        s2s.append('a', chunk)
+        expect += chunk
+      end
+      s2s['a'].must_equal expect
+      s2s.truncate('a', 10).must_equal 10
+      s2s['a'].must_equal expect[0, 10]
+      s2s.delete('a')
+      s2s.delete('b')
+      s2s.data_size.must_equal 0
+    end
+    it "should append into spare room without reallocating" do
+      s2s.append('a', 'x' * 300)
+      changes = 0
+      1000.times do
+        before = s2s.data_size
+        s2s.append('a', '0123456789')
+        changes += 1 if s2s.data_size != before
+      end
+      changes.must_be :<, 50
+      s2s['a'].size.must_equal 10305
+    end
+    it "should not change copies" do
+      copy = s2s.dup
+      s2s.append('a', '!')
+      s2s.setrange('b', 0, 'y')
+      copy.entries.must_equal [['a', 'hello'], ['b', 'x']]
+      s2s.entries.must_equal [['a', 'hello!'], ['b', 'y']]
+    end
+  end
+
+  describe "hot keys" do
+    before do
+      10.times { |i| s2s[i.to_s] = 'v' * (i * 100) }
+    end
+    it "should be off by default" do
+      s2s.tracking_hot_keys?.must_equal false
+      s2s.hot_keys.must_equal []
+      s2s.largest_items(2).map { |k, f, _| [k, f] }.must_equal [['9', nil], ['8', nil]]
+    end
+    it "should order largest items by size" do
+      500.times { |i| s2s['k%03d' % i] = 'v' * (i * 7919 % 1000 * 2) }
+      all = s2s.largest_items(s2s.size).map { |_, _, sz| sz }
+      all.size.must_equal s2s.size
+      all.must_equal all.sort.reverse
+      all.first.must_be :>=, 1998
+      s2s.largest_items(50).map { |_, _, sz| sz }.must_equal all.first(50)
+    end
+    it "should count every lookup with rate 1" do
+      s2s.track_hot_keys(1, 4)
+      s2s.tracking_hot_keys?.must_equal true
+      5.times { s2s['1'] }
+      3.times { s2s['2'] }
+      s2s.delete('2')
+      s2s['missing']
+      hot = s2s.hot_keys(2)
+      hot.map { |k, f, _| [k, f] }.must_equal [['1', 5], ['2', 4]]
+      hot[0][2].must_be :>=, 100
+      hot[1][2].must_be_nil
+      s2s.largest_items(1).map { |k, f, _| [k, f] }.must_equal [['9', 0]]
+      s2s.reset_hot_keys
+      s2s.hot_keys.must_equal []
+      s2s.track_hot_keys(false)
+      s2s.tracking_hot_keys?.must_equal false
+    end
+    it "should find heavy hitters with sampling" do
+      s2s.track_hot_keys(8, 16)
+      r = Random.new(1)
+      20000.times do |i|
+        s2s[i % 4 == 0 ? '3' : r.rand(1000).to_s]
+      end
+      key, freq, _ = s2s.hot_keys(1).first
+      key.must_equal '3'
+      freq.must_be_within_delta 5000, 2000
+    end
+  end
+
+  describe "parallel passes" do
+    let(:num) { 100_000 }
+    before do
+      @threads = InMemoryKV.threads
+      InMemoryKV.threads = 4
+    end
+    after do
+      InMemoryKV.threads = @threads
+    end
+    it "should rehash, clone and destroy big table in several threads" do
+      num.times { |i| s2s[i.to_s] = "q#{i}" }
+      copy = s2s.dup
+      copy2 = copy.dup
+      0.step(num - 1, 2) { |i| s2s[i.to_s] = 'changed' }
+      expect = (0...num).map { |i| "q#{i}" }
+      (0...num).map { |i| copy[i.to_s] }.must_equal expect
+      copy.clear
+      copy2.values.must_equal expect
+      (0...num).map { |i| s2s[i.to_s] }.must_equal expect.each_with_index.map { |v, i| i.even? ? 'changed' : v }
+    end
+    it "should validate thread count" do
+      proc { InMemoryKV.threads = 0 }.must_raise ArgumentError
+    end
+  end
+
+  describe "bulk load" do
+    it "should reserve" do
+      s2s.reserve(1000)
+      s2s.total_size.must_be :>, 1000 * 24
+      s2s['asdf'] = 'qwer'
+      s2s['asdf'].must_equal 'qwer'
+    end
+    it "should refuse negative and huge reserve counts" do
+      proc { s2s.reserve(-1) }.must_raise ArgumentError
+      proc { s2s.reserve(1 << 64) }.must_raise ArgumentError
+      s2s.size.must_equal 0
+    end
+    it "should load tsv" do
+      s2s['asdf'] = 'old'
+      s2s.bulk_load("asdf\tqwer\nzxcv\t\r\n\nyuio\tghjk").must_equal 3
+      s2s.entries.must_equal [['asdf', 'qwer'], ['zxcv', ''], ['yuio', 'ghjk']]
+    end
+    it "should load length prefixed records from io" do
+      data = ''.b
+      100.times { |i| data << [i.to_s.size, 1].pack('VV') << i.to_s << 'v' }
+      s2s.bulk_load(StringIO.new(data), format: :length_prefixed, chunk_size: 7).must_equal 100
+      s2s.size.must_equal 100
+      s2s['99'].must_equal 'v'
+    end
+    it "should reject malformed input" do
+      proc { s2s.bulk_load("asdf\n") }.must_raise ArgumentError
+      proc { s2s.bulk_load("\x01\x00\x00\x00\x05", format: :length_prefixed) }.must_raise ArgumentError
+    end
+  end
+
+  describe "lazy free" do
+    def wait_lazy_free
+      100.times { break if InMemoryKV.lazy_free_pending == 0; sleep 0.01 }
+      InMemoryKV.lazy_free_pending.must_equal 0
+    end
+    before do
+      100.times { |i| s2s[i.to_s] = "q#{i}" }
+    end
+    it "should clear asynchronously" do
+      copy = s2s.dup
+      s2s.clear(async: true)
+      s2s.size.must_equal 0
+      s2s.data_size.must_equal 0
+      s2s['1'] = 'new'
+      s2s.entries.must_equal [['1', 'new']]
+      wait_lazy_free
+      copy['1'].must_equal 'q1'
+    end
+    it "should free large items in background" do
+      big = 'x' * InMemoryKV.lazy_free_threshold
+      s2s['big'] = big
+      s2s['big'] = 'small'
+      s2s['big2'] = big
+      s2s.delete('big2').must_equal big
+      wait_lazy_free
+      s2s['big'].must_equal 'small'
+    end
+  end
+
+  describe "change feed" do
+    let(:follower) { InMemoryKV::Str2Str.new }
+    before do
+      s2s.track_changes
+      s2s['asdf'] = 'qwer'
+      s2s['qwer'] = 'zxcv'
+    end
+    it "should replay changes on follower" do
+      s2s.unshift 'zxcv', 'yuio'
+      s2s.up 'asdf'
+      s2s.delete 'qwer'
+      follower.apply_changes(s2s.take_changes)
+      follower.entries.must_equal s2s.entries
+      follower.applied_seq.must_equal s2s.change_seq
+      s2s.take_changes.must_be_empty
+    end
+    it "should replay in-place edits without resending value" do
+      follower.apply_changes(s2s.take_changes)
+      s2s['big'] = 'x' * 10000
+      s2s.append('big', 'tail')
+      s2s.prepend('asdf', '>')
+      s2s.setrange('qwer', 6, 'ab')
+      s2s.setrange('new', 2, 'cd')
+      s2s.truncate('big', 5000)
+      s2s.truncate('missing', 5)
+      s2s.append('fresh', 'v')
+      feed = s2s.take_changes
+      feed.bytesize.must_be :<, 10100
+      follower.apply_changes(feed).must_equal feed.bytesize
+      follower.entries.must_equal s2s.entries
+      follower['qwer'].must_equal "zxcv\0\0ab"
+      follower.applied_seq.must_equal s2s.change_seq
+    end
+    it "should catch up from snapshot plus tail" do
+      follower.apply_changes(s2s.snapshot)
+      s2s.clear
+      s2s['tyui'] = 'ghjk'
+      follower.apply_changes(s2s.take_changes)
+      follower.entries.must_equal [['tyui', 'ghjk']]
+    end
+    it "should apply only complete records" do
+      feed = s2s.take_changes
+      follower.apply_changes(feed[0, feed.bytesize - 1]).must_be :<, feed.bytesize
+      follower.entries.must_equal [['asdf', 'qwer']]
+    end
+    it "should apply snapshot as its pairs arrive" do
+      100.times { |i| s2s[i.to_s] = 'v' * i }
+      snap = s2s.snapshot
+      half = snap.bytesize / 2
+      consumed = follower.apply_changes(snap.byteslice(0, half))
+      consumed.must_be :>, 0
+      follower.snapshot_pending?.must_equal true
+      follower.applied_seq.must_equal 0
+      follower.apply_changes(snap.byteslice(consumed, snap.bytesize - consumed))
+      follower.snapshot_pending?.must_equal false
+      follower.applied_seq.must_equal s2s.change_seq
+      follower.entries.must_equal s2s.entries
+    end
+    it "should follow pipe" do
+      r, w = IO.pipe
+      w.binmode
+      s2s.flush_changes(w)
+      w.close
+      follower.follow(r)
+      follower.entries.must_equal s2s.entries
+    end
+  end
 end